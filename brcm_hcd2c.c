@@ -0,0 +1,187 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hcd2c.c
+**
+**  Description:   This program turns HCD files into C source holding the
+**                 records already laid out as H4 command packets, with
+**                 their offsets, for building the firmware into the
+**                 download tools.
+**
+**                 It can be invoked from the command line in the form
+**						chip_id=patchram_file ...
+**
+**                 where chip_id is the hex chip id reported by
+**                 Read_Verbose_Config for the chips the file is for.
+**
+**                 For example:
+**
+**                 brcm_hcd2c 29=BCM4329B1.hcd 43=BCM4330B2.hcd \
+**						> brcm_hci_firmware.c
+**
+**                 The Makefile does this when FIRMWARE is set.
+**
+**                 It will return 0 for success and a number greater than 0
+**                 for any errors.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char uchar;
+
+/*
+** Writes the records of one file as an array of H4 command packets and
+** the offset of each packet in it, collected on the same pass.
+*/
+int
+emit(int n, char *name)
+{
+	uchar record[3 + 255];
+	int *records = NULL;
+	int offset = 0;
+	int count = 0;
+	int size = 0;
+	long pos;
+	int got;
+	int len;
+	int i;
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "file %s could not be opened, error %d\n",
+			name, errno);
+		return(1);
+	}
+
+	printf("static const uchar firmware_%d[] = {", n);
+
+	while (1) {
+		pos = ftell(fp);
+
+		if ((got = fread(record, 1, 3, fp)) == 0 && feof(fp)) {
+			break;
+		}
+
+		len = record[2];
+
+		if (got < 3 || fread(&record[3], 1, len, fp) != len) {
+			fprintf(stderr, "file %s %s at offset %ld\n", name,
+				ferror(fp) ? "could not be read" : "truncated", pos);
+			free(records);
+			fclose(fp);
+			return(1);
+		}
+
+		if (count == size) {
+			size = size ? 2 * size : 256;
+
+			if ((records = realloc(records, size * sizeof(int))) == NULL) {
+				fprintf(stderr, "no memory for %d records\n", size);
+				fclose(fp);
+				return(1);
+			}
+		}
+
+		records[count++] = offset;
+
+		printf("\n\t0x01,");
+
+		for (i = 0; i < 3 + len; i++) {
+			printf("%s0x%02x,", i % 12 == 11 ? "\n\t" : " ", record[i]);
+		}
+
+		offset += 1 + 3 + len;
+	}
+
+	printf("\n};\n\n");
+
+	fclose(fp);
+
+	if (count == 0) {
+		fprintf(stderr, "file %s has no records\n", name);
+		return(1);
+	}
+
+	printf("static const int records_%d[] = {", n);
+
+	for (i = 0; i < count; i++) {
+		printf("%s%d,", i % 8 ? " " : "\n\t", records[i]);
+	}
+
+	printf("\n};\n\n");
+
+	free(records);
+
+	return(0);
+}
+
+int
+main(int argc, char **argv)
+{
+	int chip_id;
+	char *name;
+	int i;
+
+	if (argc < 2) {
+		printf("Usage %s:\n", argv[0]);
+		printf("\tchip_id=patchram_file ...\n");
+		exit(1);
+	}
+
+	printf("/* Generated by brcm_hcd2c, do not edit. */\n\n");
+	printf("#include <stddef.h>\n\n");
+	printf("#include \"brcm_hci_engine.h\"\n\n");
+
+	for (i = 1; i < argc; i++) {
+		if ((name = strchr(argv[i], '=')) == NULL) {
+			fprintf(stderr, "%s is not chip_id=patchram_file\n", argv[i]);
+			exit(2);
+		}
+
+		*name++ = '\0';
+
+		if (emit(i, name)) {
+			exit(3);
+		}
+
+		name[-1] = '=';
+	}
+
+	printf("const tEmbeddedFirmware embedded_firmware[] = {\n");
+
+	for (i = 1; i < argc; i++) {
+		name = strchr(argv[i], '=');
+		*name++ = '\0';
+		chip_id = strtol(argv[i], NULL, 16);
+
+		printf("\t{ 0x%02x, \"%s\", firmware_%d, sizeof(firmware_%d),\n"
+			"\t\trecords_%d, sizeof(records_%d) / sizeof(int) },\n",
+			chip_id, name, i, i, i, i);
+	}
+
+	printf("\t{ -1, NULL, NULL, 0, NULL, 0 }\n};\n");
+
+	exit(0);
+}
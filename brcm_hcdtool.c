@@ -0,0 +1,480 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hcdtool.c
+**
+**  Description:   This program examines patchram files in the HCD format.
+**
+**                 It can be invoked from the command line in the form
+**						analyze
+**						<--latency=microseconds the controller takes to
+**							complete a Write_RAM.  Default is 250.>
+**						<--turnaround=microseconds the host takes to
+**							send the next record.  Default is 100.>
+**						patchram_file
+**
+**                 or
+**						index
+**						chip_id[:lmp_subversion]=patchram_file ...
+**
+**                 analyze prints the record count, an opcode histogram,
+**                 the payload sizes, the memory written by Write_RAM with
+**                 its gaps, how many records could be merged, the bytes
+**                 on the wire with H4 and H5 framing, and the download
+**                 time predicted for every baud rate brcm_patchram_plus
+**                 supports and a range of --window values.
+**
+**                 index prints the brcm_firmware.idx lines for the files
+**                 given, to be used with --firmware_dir.  chip_id and
+**                 lmp_subversion are hex, the file names should be
+**                 relative to the firmware directory.
+**
+**                 For example:
+**
+**                 brcm_hcdtool analyze BCM4329B1.hcd
+**                 brcm_hcdtool index 29=BCM4329B1.hcd 43:4130=BCM4330B2.hcd \
+**						> brcm_firmware.idx
+**
+**                 It will return 0 for success and a number greater than 0
+**                 for any errors.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_hcdtool"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_uart.h"
+
+#define HCI_WRITE_RAM		0xfc4c
+#define WRITE_RAM_ADDR		4
+#define MAX_PAYLOAD		255
+
+/* bytes in the Command Complete event for each record */
+#define H4_EVENT_BYTES		7
+
+/* SLIP delimiters, packet header and data integrity check */
+#define H5_OVERHEAD		8
+
+/* the host acknowledges every reliable packet from the controller */
+#define H5_ACK_BYTES		8
+
+typedef struct {
+	int opcode;
+	int count;
+	int bytes;
+} tOpcodeCount;
+
+typedef struct {
+	unsigned int addr;
+	int len;
+} tRegion;
+
+int latency_us = 250;
+int turnaround_us = 100;
+
+int windows[] = { 1, 2, 4, 8, 16 };
+
+uchar *hcd;
+int hcd_size;
+
+static int
+h5_escapes(uchar *data, int len)
+{
+	int n = 0;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] == 0xc0 || data[i] == 0xdb) {
+			n++;
+		}
+	}
+
+	return(n);
+}
+
+static int
+compare_regions(const void *a, const void *b)
+{
+	const tRegion *ra = a;
+	const tRegion *rb = b;
+
+	if (ra->addr != rb->addr) {
+		return(ra->addr < rb->addr ? -1 : 1);
+	}
+
+	return(0);
+}
+
+static int
+load_file(char *name)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "file %s could not be opened, error %d\n",
+			name, errno);
+		return(1);
+	}
+
+	hcd_size = st.st_size;
+	hcd = malloc(hcd_size + 1);
+
+	if (read(fd, hcd, hcd_size) != hcd_size) {
+		fprintf(stderr, "file %s could not be read, error %d\n",
+			name, errno);
+		close(fd);
+		return(1);
+	}
+
+	close(fd);
+
+	return(0);
+}
+
+/*
+** Steady state time per record.  With a window of one the command, the
+** controller and the event all happen in turn.  With a larger window they
+** overlap, until the slowest of them sets the pace.
+*/
+static double
+record_us(double tx_us, double rx_us, int window)
+{
+	double t = (tx_us + latency_us + rx_us + turnaround_us) / window;
+
+	if (t < tx_us) {
+		t = tx_us;
+	}
+
+	if (t < rx_us) {
+		t = rx_us;
+	}
+
+	if (t < latency_us) {
+		t = latency_us;
+	}
+
+	return(t);
+}
+
+int
+proc_analyze(char *name)
+{
+	tOpcodeCount opcodes[64];
+	tRegion *regions;
+	int sizes[5] = { 0, 0, 0, 0, 0 };
+	int limits[5] = { 16, 64, 128, 192, 256 };
+	int opcode_count = 0;
+	int region_count = 0;
+	int records = 0;
+	int payload = 0;
+	int min_len = MAX_PAYLOAD;
+	int max_len = 0;
+	int merged = 0;
+	int run = 0;
+	long h4_bytes = 0;
+	long h5_bytes = 0;
+	unsigned int next = 0;
+	unsigned int addr;
+	unsigned int end;
+	double tx_us;
+	double rx_us;
+	int opcode;
+	int pos;
+	int len;
+	int i;
+	int j;
+
+	if (load_file(name)) {
+		return(2);
+	}
+
+	regions = malloc((hcd_size / 3 + 1) * sizeof(tRegion));
+
+	for (pos = 0; pos + 3 <= hcd_size; pos += 3 + len) {
+		opcode = hcd[pos] | (hcd[pos + 1] << 8);
+		len = hcd[pos + 2];
+
+		if (pos + 3 + len > hcd_size) {
+			fprintf(stderr, "record %d at offset %d is truncated\n",
+				records + 1, pos);
+			return(3);
+		}
+
+		records++;
+		payload += len;
+
+		if (len < min_len) {
+			min_len = len;
+		}
+
+		if (len > max_len) {
+			max_len = len;
+		}
+
+		for (i = 0; len >= limits[i]; i++)
+			;
+		sizes[i]++;
+
+		for (i = 0; i < opcode_count && opcodes[i].opcode != opcode; i++)
+			;
+
+		if (i == opcode_count && opcode_count < 64) {
+			opcodes[opcode_count].opcode = opcode;
+			opcodes[opcode_count].count = 0;
+			opcodes[opcode_count].bytes = 0;
+			opcode_count++;
+		}
+
+		if (i < opcode_count) {
+			opcodes[i].count++;
+			opcodes[i].bytes += len;
+		}
+
+		h4_bytes += 1 + 3 + len + H4_EVENT_BYTES;
+		h5_bytes += H5_OVERHEAD + 3 + len + h5_escapes(&hcd[pos], 3 + len) +
+			H5_OVERHEAD + H4_EVENT_BYTES - 1 + H5_ACK_BYTES;
+
+		if (opcode != HCI_WRITE_RAM || len < WRITE_RAM_ADDR) {
+			run = 0;
+			continue;
+		}
+
+		addr = hcd[pos + 3] | (hcd[pos + 4] << 8) |
+			(hcd[pos + 5] << 16) | (hcd[pos + 6] << 24);
+
+		regions[region_count].addr = addr;
+		regions[region_count].len = len - WRITE_RAM_ADDR;
+		region_count++;
+
+		/* contiguous with the previous record and still fits in one */
+		if (run && addr == next &&
+			run + len - WRITE_RAM_ADDR <= MAX_PAYLOAD) {
+			merged++;
+			run += len - WRITE_RAM_ADDR;
+		} else {
+			run = len;
+		}
+
+		next = addr + len - WRITE_RAM_ADDR;
+	}
+
+	if (pos != hcd_size) {
+		fprintf(stderr, "%d bytes after the last record\n", hcd_size - pos);
+		return(3);
+	}
+
+	printf("%s: %d bytes, %d records\n\n", name, hcd_size, records);
+
+	if (records == 0) {
+		return(0);
+	}
+
+	printf("opcode  records    bytes\n");
+
+	for (i = 0; i < opcode_count; i++) {
+		printf("%04x    %7d  %7d%s\n", opcodes[i].opcode, opcodes[i].count,
+			opcodes[i].bytes,
+			opcodes[i].opcode == HCI_WRITE_RAM ? "  Write_RAM" :
+			opcodes[i].opcode == 0xfc4e ? "  Launch_RAM" : "");
+	}
+
+	printf("\npayload sizes: min %d, max %d, mean %d\n", min_len, max_len,
+		payload / records);
+
+	for (i = 0; i < 5; i++) {
+		printf("  %3d - %3d  %7d\n", i ? limits[i - 1] : 0, limits[i] - 1,
+			sizes[i]);
+	}
+
+	if (payload / records < 64) {
+		printf("records are small, the download is dominated by per record"
+			" overhead\n");
+	}
+
+	qsort(regions, region_count, sizeof(tRegion), compare_regions);
+
+	printf("\nWrite_RAM regions:\n");
+
+	for (i = 0; i < region_count; i = j) {
+		addr = regions[i].addr;
+		end = addr + regions[i].len;
+
+		for (j = i + 1; j < region_count && regions[j].addr <= end; j++) {
+			if (regions[j].addr < end) {
+				printf("  overlap at %08x\n", regions[j].addr);
+			}
+
+			if (regions[j].addr + regions[j].len > end) {
+				end = regions[j].addr + regions[j].len;
+			}
+		}
+
+		printf("  %08x - %08x  %7u bytes, %d records\n", addr, end - 1,
+			end - addr, j - i);
+
+		if (j < region_count) {
+			printf("  gap         %7u bytes\n", regions[j].addr - end);
+		}
+	}
+
+	printf("\n%d Write_RAM records could be merged into their predecessor,"
+		" saving %d bytes\n", merged,
+		merged * (1 + 3 + WRITE_RAM_ADDR + H4_EVENT_BYTES));
+
+	printf("\nwire bytes: H4 %ld, H5 %ld\n", h4_bytes, h5_bytes);
+
+	printf("\npredicted H4 download time in ms, with %d us controller "
+		"latency\nand %d us host turnaround per record\n\n",
+		latency_us, turnaround_us);
+
+	printf("   baud  window");
+
+	for (j = 0; j < sizeof(windows) / sizeof(windows[0]); j++) {
+		printf(" %7d", windows[j]);
+	}
+
+	printf("\n");
+
+	for (i = 0; i < baud_rates_count; i++) {
+		printf("%7d        ", baud_rates[i].baud_rate);
+
+		for (j = 0; j < sizeof(windows) / sizeof(windows[0]); j++) {
+			/* 8N1, ten bits per byte */
+			tx_us = (h4_bytes - records * H4_EVENT_BYTES) * 10e6 /
+				baud_rates[i].baud_rate / records;
+			rx_us = H4_EVENT_BYTES * 10e6 / baud_rates[i].baud_rate;
+
+			printf(" %7.0f", records *
+				record_us(tx_us, rx_us, windows[j]) / 1000);
+		}
+
+		printf("\n");
+	}
+
+	return(0);
+}
+
+int
+proc_index(int argc, char **argv)
+{
+	char *subver;
+	char *name;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if ((name = strchr(argv[i], '=')) == NULL) {
+			fprintf(stderr, "%s is not chip_id=patchram_file\n", argv[i]);
+			return(1);
+		}
+
+		*name++ = '\0';
+
+		if ((subver = strchr(argv[i], ':')) != NULL) {
+			*subver++ = '\0';
+		}
+
+		if (load_file(name)) {
+			return(2);
+		}
+
+		printf("%02lx %s %s %016llx\n", strtol(argv[i], NULL, 16),
+			subver ? subver : "*", name, hcd_digest(hcd, hcd_size));
+
+		free(hcd);
+	}
+
+	return(0);
+}
+
+void
+usage(char *argv0)
+{
+	printf("Usage %s:\n", argv0);
+	printf("\tanalyze\n");
+	printf("\t\t<--latency=microseconds>\n");
+	printf("\t\t<--turnaround=microseconds>\n");
+	printf("\t\tpatchram_file\n");
+	printf("\tindex\n");
+	printf("\t\tchip_id[:lmp_subversion]=patchram_file ...\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"latency", 1, 0, 0},
+		{"turnaround", 1, 0, 0},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+	int c;
+
+	if (argc > 2 && strcmp(argv[1], "index") == 0) {
+		exit(proc_index(argc - 2, &argv[2]));
+	}
+
+	if (argc < 2 || strcmp(argv[1], "analyze")) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	optind = 2;
+
+	while ((c = getopt_long_only(argc, argv, "", long_options,
+		&option_index)) != -1) {
+		if (c != 0) {
+			usage(argv[0]);
+			exit(1);
+		}
+
+		if (option_index == 0) {
+			latency_us = atoi(optarg);
+		} else {
+			turnaround_us = atoi(optarg);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	exit(proc_analyze(argv[optind]));
+}
@@ -0,0 +1,192 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_deadline.c
+**
+**  Description:   Time budget for the whole run.
+**
+**                 With --deadline=ms no wait for the controller lasts
+**                 past the end of the budget, counted from the start of
+**                 the program.  When it runs out the report is printed
+**                 and the program exits with 9.
+**
+**                 Each phase also gets a share of the budget from the
+**                 time it starts.  A phase that overruns its share falls
+**                 back to safer settings and carries on with what is
+**                 left of the whole: the baud rate switch is given up
+**                 unless HCI_Reset shows the controller took it, the
+**                 download and the configuration go on one command at a
+**                 time.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+int deadline = 0;
+
+static unsigned int deadline_end;
+static unsigned int phase_end;
+static int phase = -1;
+static int overruns = 0;
+
+/* percent of the budget for each phase */
+static int phase_share[] = { 15, 10, 60, 15 };
+
+static char *phase_name[] = { "reset", "baud rate", "download", "config" };
+
+int
+parse_deadline(char *optarg)
+{
+	deadline = atoi(optarg);
+
+	if (deadline <= 0) {
+		return(1);
+	}
+
+	deadline_end = now_ms() + deadline;
+
+	return(0);
+}
+
+void
+phase_start(int next)
+{
+	if (!deadline) {
+		return;
+	}
+
+	phase = next;
+	phase_end = now_ms() + deadline * phase_share[phase] / 100;
+}
+
+/*
+** Milliseconds left of the current phase, or -1 without --deadline.
+*/
+int
+phase_timeout()
+{
+	int left;
+
+	if (!deadline) {
+		return(-1);
+	}
+
+	left = phase_end - now_ms();
+
+	return(left > 0 ? left : 0);
+}
+
+/*
+** True once the current phase has used up its share.  The first time
+** is noted for the report.
+*/
+int
+phase_over()
+{
+	if (!deadline || phase < 0 || (int)(phase_end - now_ms()) > 0) {
+		return(0);
+	}
+
+	if (!(overruns & (1 << phase))) {
+		overruns |= 1 << phase;
+
+		if (debug) {
+			fprintf(stderr, "%s over its share of the deadline\n",
+				phase_name[phase]);
+		}
+	}
+
+	return(1);
+}
+
+/*
+** Shortens timeout_ms, -1 meaning none, to what is left of the budget.
+*/
+int
+deadline_clamp(int timeout_ms)
+{
+	int left;
+
+	if (!deadline) {
+		return(timeout_ms);
+	}
+
+	left = deadline_end - now_ms();
+
+	if (left < 0) {
+		left = 0;
+	}
+
+	return(timeout_ms < 0 || timeout_ms > left ? left : timeout_ms);
+}
+
+/*
+** Called after a wait came back empty, stops the run if the budget is
+** gone.
+*/
+void
+deadline_check()
+{
+	if (!deadline || (int)(deadline_end - now_ms()) > 0) {
+		return;
+	}
+
+	fprintf(stderr, "deadline of %d ms reached during %s\n", deadline,
+		phase >= 0 ? phase_name[phase] : "start up");
+
+	engine_report();
+
+	exit(9);
+}
+
+void
+deadline_report()
+{
+	int i;
+
+	fprintf(stderr, "deadline %d ms, %d ms left", deadline,
+		deadline_clamp(-1));
+
+	for (i = 0; i < sizeof(phase_share) / sizeof(phase_share[0]); i++) {
+		if (overruns & (1 << i)) {
+			fprintf(stderr, ", %s over", phase_name[i]);
+		}
+	}
+
+	fprintf(stderr, "\n");
+}
@@ -0,0 +1,379 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_duplex.c
+**
+**  Description:   Full duplex mode for the pipelined part of the download.
+**
+**                 With --duplex the real transport is wrapped while
+**                 send_commands() runs.  A TX thread writes the commands
+**                 queued by the engine and an RX thread reads and frames
+**                 the events, so a write held up by flow control never
+**                 delays reading a completion and the other way round.
+**
+**                 Each direction is a single producer, single consumer
+**                 ring published with acquire and release ordering.  A
+**                 semaphore counts the filled slots so that an idle
+**                 thread sleeps instead of spinning.  The RX thread waits
+**                 on the transport's descriptor and on a pipe that
+**                 duplex_stop() writes to, so stopping it takes no time,
+**                 and then reads a whole event however slowly it comes.
+**                 A transport without a descriptor is not wrapped.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define DUPLEX_SLOTS		64
+#define DUPLEX_MAX_PACKET	260
+
+typedef struct {
+	int len;
+	unsigned int generation;
+	uchar data[DUPLEX_MAX_PACKET];
+} tDuplexSlot;
+
+typedef struct {
+	tDuplexSlot slots[DUPLEX_SLOTS];
+	unsigned int head;
+	unsigned int tail;
+	sem_t filled;
+} tDuplexRing;
+
+int duplex = 0;
+
+static tDuplexRing tx_ring;
+static tDuplexRing rx_ring;
+
+static tHciTransport *inner;
+static pthread_t tx_thread;
+static pthread_t rx_thread;
+static volatile int rx_running = 0;
+static int rx_wake[2] = { -1, -1 };
+
+/* commands queued before the last flush are not sent */
+static unsigned int tx_generation = 0;
+
+int
+parse_duplex(char *optarg)
+{
+	duplex = 1;
+	return(0);
+}
+
+static int
+ring_put(tDuplexRing *ring, uchar *buf, int len, unsigned int generation)
+{
+	unsigned int head = ring->head;
+	tDuplexSlot *slot;
+
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+		DUPLEX_SLOTS) {
+		return(0);
+	}
+
+	slot = &ring->slots[head % DUPLEX_SLOTS];
+	slot->len = len;
+	slot->generation = generation;
+
+	if (len > 0) {
+		memcpy(slot->data, buf, len);
+	}
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&ring->filled);
+
+	return(1);
+}
+
+/*
+** Only called once the semaphore says a slot is filled.  It was posted
+** after the slot was published, so the slot is there to be read.
+*/
+static tDuplexSlot *
+ring_peek(tDuplexRing *ring)
+{
+	return(&ring->slots[ring->tail % DUPLEX_SLOTS]);
+}
+
+static void
+ring_release(tDuplexRing *ring)
+{
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *
+duplex_tx(void *arg)
+{
+	tDuplexSlot *slot;
+
+	while (1) {
+		while (sem_wait(&tx_ring.filled) == -1 && errno == EINTR)
+			;
+
+		slot = ring_peek(&tx_ring);
+
+		if (slot->len == 0) {
+			ring_release(&tx_ring);
+			break;
+		}
+
+		if (slot->generation ==
+			__atomic_load_n(&tx_generation, __ATOMIC_ACQUIRE)) {
+			inner->send(slot->data, slot->len);
+		}
+
+		ring_release(&tx_ring);
+	}
+
+	return(NULL);
+}
+
+/*
+** Waits for the transport to have something to read.  Returns 0 once
+** duplex_stop() asks the thread to finish.
+*/
+static int
+rx_wait()
+{
+	struct pollfd pfd[2];
+
+	pfd[0].fd = *inner->fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = rx_wake[0];
+	pfd[1].events = POLLIN;
+
+	while (poll(pfd, 2, -1) == -1) {
+		if (errno != EINTR) {
+			return(0);
+		}
+	}
+
+	return(!pfd[1].revents);
+}
+
+static void *
+duplex_rx(void *arg)
+{
+	uchar buf[DUPLEX_MAX_PACKET];
+	int len;
+
+	while (rx_wait()) {
+		/* an event that has started is read to its end */
+		if ((len = inner->read_event(buf, sizeof(buf),
+			HCI_RECORD_TIMEOUT_MS)) == 0) {
+			continue;
+		}
+
+		while (!ring_put(&rx_ring, buf, len, 0)) {
+			usleep(1000);
+		}
+
+		if (len < 0) {
+			break;
+		}
+	}
+
+	return(NULL);
+}
+
+static int
+duplex_send(uchar *buf, int len)
+{
+	unsigned int generation =
+		__atomic_load_n(&tx_generation, __ATOMIC_RELAXED);
+
+	while (!ring_put(&tx_ring, buf, len, generation)) {
+		usleep(100);
+	}
+
+	return(len);
+}
+
+static int
+duplex_read_event(uchar *buf, int size, int timeout_ms)
+{
+	struct timespec ts;
+	tDuplexSlot *slot;
+	int len;
+	int rc;
+
+	if (timeout_ms < 0) {
+		while ((rc = sem_wait(&rx_ring.filled)) == -1 && errno == EINTR)
+			;
+	} else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+
+		while ((rc = sem_timedwait(&rx_ring.filled, &ts)) == -1 &&
+			errno == EINTR)
+			;
+	}
+
+	if (rc == -1) {
+		return(0);
+	}
+
+	slot = ring_peek(&rx_ring);
+	len = slot->len;
+
+	if (len > size) {
+		len = -1;
+	} else if (len > 0) {
+		memcpy(buf, slot->data, len);
+	}
+
+	ring_release(&rx_ring);
+
+	return(len);
+}
+
+/*
+** Drops whatever has been queued but not yet written, and every event
+** that has been read but not yet taken.
+*/
+static void
+duplex_flush()
+{
+	__atomic_add_fetch(&tx_generation, 1, __ATOMIC_RELEASE);
+
+	while (sem_trywait(&rx_ring.filled) == 0) {
+		ring_peek(&rx_ring);
+		ring_release(&rx_ring);
+	}
+
+	if (inner->flush) {
+		inner->flush();
+	}
+}
+
+static tHciTransport duplex_transport = {
+	"duplex", duplex_send, duplex_read_event, NULL, NULL, duplex_flush
+};
+
+static void
+rx_close()
+{
+	if (rx_wake[0] >= 0) {
+		close(rx_wake[0]);
+		close(rx_wake[1]);
+		rx_wake[0] = rx_wake[1] = -1;
+	}
+}
+
+void
+duplex_start()
+{
+	if (!duplex || transport == &duplex_transport ||
+		transport->fd == NULL) {
+		return;
+	}
+
+	inner = transport;
+
+	duplex_transport.name = inner->name;
+	duplex_transport.default_speed = inner->default_speed;
+	duplex_transport.fd = inner->fd;
+
+	memset(&tx_ring, 0, sizeof(tx_ring));
+	memset(&rx_ring, 0, sizeof(rx_ring));
+	sem_init(&tx_ring.filled, 0, 0);
+	sem_init(&rx_ring.filled, 0, 0);
+
+	rx_running = 1;
+
+	if (pipe(rx_wake) == -1) {
+		return;
+	}
+
+	if (pthread_create(&tx_thread, NULL, duplex_tx, NULL) != 0) {
+		rx_close();
+		return;
+	}
+
+	if (pthread_create(&rx_thread, NULL, duplex_rx, NULL) != 0) {
+		ring_put(&tx_ring, NULL, 0, 0);
+		pthread_join(tx_thread, NULL);
+		rx_close();
+		return;
+	}
+
+	transport = &duplex_transport;
+}
+
+/*
+** Waits for the queued commands to be written and hands the transport
+** back.  Nothing is outstanding by now, so the RX thread has nothing
+** left to read.
+*/
+void
+duplex_stop()
+{
+	if (transport != &duplex_transport) {
+		return;
+	}
+
+	ring_put(&tx_ring, NULL, 0, 0);
+	pthread_join(tx_thread, NULL);
+
+	rx_running = 0;
+
+	if (rx_wake[1] >= 0) {
+		write(rx_wake[1], "", 1);
+	}
+
+	pthread_join(rx_thread, NULL);
+	rx_close();
+
+	sem_destroy(&tx_ring.filled);
+	sem_destroy(&rx_ring.filled);
+
+	transport = inner;
+}
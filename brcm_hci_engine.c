@@ -0,0 +1,919 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_engine.c
+**
+**  Description:   HCD download engine shared by all brcm_patchram_plus
+**                 variants.  The HCD file is read into memory by a
+**                 background thread while the controller is being reset,
+**                 and then sent record by record through the registered
+**                 transport.
+**
+**                 Up to "window" records are kept outstanding, bounded
+**                 by the Num_HCI_Command_Packets credits the controller
+**                 returns in its Command Complete events.  A window of 1
+**                 is the classic stop-and-wait download.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+tHciTransport *transport = NULL;
+tEngineStats stats;
+
+int debug = 0;
+int hcdfile_fd = -1;
+int no2bytes = 0;
+int tosleep = 0;
+int baud_settle = 0;
+int window = 1;
+int record_timeout = HCI_RECORD_TIMEOUT_MS;
+int record_retries = 3;
+uchar chip_id = 0;
+
+/*
+** The download runs above the default rate.  Whether the controller
+** keeps that rate after Launch_RAM is 1 if known to, -1 if known not to
+** and 0 if not known, which --tune finds out once.
+*/
+int launch_at_speed = 0;
+int launch_keeps_speed = 0;
+int launch_learn = 0;
+
+uchar buffer[1024];
+
+uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
+
+uchar hci_download_minidriver[] = { 0x01, 0x2e, 0xfc, 0x00 };
+
+uchar hci_read_verbose_config_version_info[] =
+	{ 0x01, 0x79, 0xfc, 0x00 };
+
+static uchar *hcd_data = NULL;
+static int hcd_len = 0;
+static int *hcd_records = NULL;
+static int hcd_count = 0;
+
+static int hcd_fds[HCD_MAX_FILES];
+static int hcd_files = 0;
+
+static pthread_t hcd_thread;
+static int hcd_loading = 0;
+
+/* refreshed by whichever thread reads the events, as with --stream */
+static int credits = 1;
+
+unsigned int
+now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+unsigned long long
+now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+/*
+** Takes one HCD file, or several separated by commas.  --patchram can
+** also be given more than once, the files are sent in the order given.
+*/
+int
+parse_patchram(char *optarg)
+{
+	char *name;
+	char *p;
+
+	for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+		if (!(p = strrchr(name, '.'))) {
+			fprintf(stderr, "file %s not an HCD file\n", name);
+			exit(3);
+		}
+
+		p++;
+
+		if (strcasecmp("hcd", p) != 0) {
+			fprintf(stderr, "file %s not an HCD file\n", name);
+			exit(4);
+		}
+
+		if (hcd_files == HCD_MAX_FILES) {
+			fprintf(stderr, "no more than %d patchram files\n",
+				HCD_MAX_FILES);
+			exit(3);
+		}
+
+		if ((hcd_fds[hcd_files++] = open(name, O_RDONLY)) == -1) {
+			fprintf(stderr, "file %s could not be opened, error %d\n",
+				name, errno);
+			exit(5);
+		}
+	}
+
+	hcdfile_fd = hcd_fds[0];
+
+	return(0);
+}
+
+int
+parse_window(char *optarg)
+{
+	window = atoi(optarg);
+
+	if (window <= 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_record_timeout(char *optarg)
+{
+	record_timeout = atoi(optarg);
+
+	if (record_timeout < 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_record_retries(char *optarg)
+{
+	record_retries = atoi(optarg);
+
+	if (record_retries < 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_launch_keeps_baudrate(char *optarg)
+{
+	launch_keeps_speed = 1;
+	return(0);
+}
+
+/*
+** Returns 0 once the whole packet has been handed to the transport, -1
+** if it could not be, in which case part of it may be on the wire.
+*/
+int
+hci_send_cmd(uchar *buf, int len)
+{
+	if (debug_log) {
+		log_packet("writing", buf, len);
+	}
+
+	stats.commands++;
+
+	if (btsnoop_fd >= 0) {
+		btsnoop_log(buf, len, 0);
+	}
+
+	if (transport->send(buf, len) != len) {
+		stats.tx_failed++;
+		return(-1);
+	}
+
+	return(0);
+}
+
+/*
+** For a command whose answer is waited for without a timeout, which
+** would never come for a command cut short.
+*/
+void
+hci_send_cmd_or_exit(uchar *buf, int len)
+{
+	if (hci_send_cmd(buf, len) < 0) {
+		fprintf(stderr, "command %02x%02x could not be written\n",
+			buf[2], buf[1]);
+		exit(6);
+	}
+}
+
+/*
+** Returns the length of the event read into buf, 0 on timeout.  The
+** controller's command credits are refreshed from every Command Complete
+** or Command Status event that goes past.
+*/
+int
+read_event_timeout(uchar *buf, int timeout_ms)
+{
+	int count;
+
+	count = transport->read_event(buf, sizeof(buffer),
+		deadline_clamp(timeout_ms));
+
+	if (count < 0) {
+		fprintf(stderr, "%s transport read failed, error %d\n",
+			transport->name, errno);
+		exit(6);
+	}
+
+	if (count == 0) {
+		deadline_check();
+		return(0);
+	}
+
+	stats.events++;
+
+	if (btsnoop_fd >= 0) {
+		btsnoop_log(buf, count, 1);
+	}
+
+	if (buf[1] == HCI_EV_CMD_COMPLETE && count > 3) {
+		__atomic_store_n(&credits, buf[3], __ATOMIC_RELAXED);
+	} else if (buf[1] == HCI_EV_CMD_STATUS && count > 4) {
+		__atomic_store_n(&credits, buf[4], __ATOMIC_RELAXED);
+	}
+
+	if (debug_log) {
+		log_packet("received", buf, count);
+	}
+
+	return(count);
+}
+
+int
+read_event(uchar *buf)
+{
+	return(read_event_timeout(buf, -1));
+}
+
+/*
+** Waits up to timeout_ms for the Command Complete of HCI_Reset, passing
+** over anything else, such as late completions of earlier commands.
+*/
+int
+wait_reset(int timeout_ms)
+{
+	unsigned int end = now_ms() + timeout_ms;
+	int left;
+
+	while ((left = end - now_ms()) > 0) {
+		if (!read_event_timeout(buffer, left)) {
+			break;
+		}
+
+		if (buffer[1] == HCI_EV_CMD_COMPLETE &&
+			buffer[4] == hci_reset[1] && buffer[5] == hci_reset[2]) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+void
+proc_reset()
+{
+	unsigned int start = now_ms();
+
+	do {
+		hci_send_cmd(hci_reset, sizeof(hci_reset));
+		stats.resets++;
+	} while (!wait_reset(HCI_RESET_TIMEOUT_MS));
+
+	stats.reset_ms += now_ms() - start;
+}
+
+/*
+** After Launch_RAM the controller may come back at the rate the download
+** ran at or at its default.  The rate in use is tried first, briefly,
+** only if this controller is known to keep it or --tune is finding out.
+*/
+static void
+proc_launch_reset()
+{
+	if (launch_at_speed && (launch_keeps_speed > 0 ||
+		(launch_keeps_speed == 0 && launch_learn))) {
+		hci_send_cmd(hci_reset, sizeof(hci_reset));
+		stats.resets++;
+
+		if (wait_reset(HCI_LAUNCH_TIMEOUT_MS)) {
+			launch_keeps_speed = 1;
+			return;
+		}
+
+		if (debug) {
+			fprintf(stderr, "controller is back at its default rate\n");
+		}
+
+		launch_keeps_speed = -1;
+
+		if (transport->flush) {
+			transport->flush();
+		}
+	}
+
+	if (transport->default_speed) {
+		transport->default_speed();
+	}
+
+	proc_reset();
+}
+
+void
+proc_read_chip_id()
+{
+	hci_send_cmd_or_exit(hci_read_verbose_config_version_info,
+		sizeof(hci_read_verbose_config_version_info));
+
+	read_event(buffer);
+
+	chip_id = buffer[7];
+
+	if (debug) {
+		fprintf(stderr, "chip_id is %02x\n", chip_id);
+	}
+
+	if (chip_id == CHIP_ID_4330B2) {
+		no2bytes = 1;
+	}
+
+	tune_chip();
+}
+
+static uchar *
+read_hcd(int fd, int *len)
+{
+	struct stat st;
+	uchar *raw;
+	int count;
+	int i;
+
+	if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+		fprintf(stderr, "HCD file could not be read, error %d\n", errno);
+		exit(6);
+	}
+
+	*len = st.st_size;
+
+	if ((raw = malloc(*len)) == NULL) {
+		fprintf(stderr, "no memory for %d byte HCD file\n", *len);
+		exit(6);
+	}
+
+	for (i = 0; i < *len; i += count) {
+		count = read(fd, &raw[i], *len - i);
+
+		if (count <= 0) {
+			fprintf(stderr, "HCD file could not be read, error %d\n", errno);
+			exit(6);
+		}
+	}
+
+	return(raw);
+}
+
+static int
+is_launch_ram(uchar *record)
+{
+	return((record[0] | (record[1] << 8)) == HCI_LAUNCH_RAM);
+}
+
+/*
+** Reads the whole of every HCD file, checks that no record runs past the
+** end of its file and lays the records out as ready to send H4 command
+** packets, one file after the other.  Only the last file's Launch_RAM is
+** kept, so the files all go in one minidriver session.  A file that is
+** byte for byte the same as an earlier one is left out.
+*/
+static void
+load_hcd()
+{
+	unsigned int start = now_ms();
+	unsigned long long digest[HCD_MAX_FILES];
+	uchar *raw[HCD_MAX_FILES];
+	int len[HCD_MAX_FILES];
+	int total = 0;
+	int last;
+	int count;
+	int f;
+	int g;
+	int i;
+
+	/* --firmware_dir opens its file after parse_patchram() is done */
+	if (hcd_files == 0) {
+		hcd_fds[hcd_files++] = hcdfile_fd;
+	}
+
+	for (f = 0, last = 0; f < hcd_files; f++) {
+		raw[f] = read_hcd(hcd_fds[f], &len[f]);
+		digest[f] = hcd_digest(raw[f], len[f]);
+
+		if (firmware_digest && digest[f] != firmware_digest) {
+			fprintf(stderr, "HCD file does not match the firmware index\n");
+			exit(6);
+		}
+
+		for (g = 0; g < f; g++) {
+			if (raw[g] && digest[g] == digest[f] && len[g] == len[f] &&
+				memcmp(raw[g], raw[f], len[f]) == 0) {
+				break;
+			}
+		}
+
+		if (g < f) {
+			if (debug) {
+				fprintf(stderr, "patchram file %d is the same as file %d, "
+					"skipped\n", f + 1, g + 1);
+			}
+
+			free(raw[f]);
+			raw[f] = NULL;
+			continue;
+		}
+
+		for (i = 0; i < len[f]; i += HCD_RECORD_HDR + raw[f][i + 2]) {
+			if (i + HCD_RECORD_HDR > len[f] ||
+				i + HCD_RECORD_HDR + raw[f][i + 2] > len[f]) {
+				fprintf(stderr, "HCD file %d truncated at offset %d\n",
+					f + 1, i);
+				exit(6);
+			}
+
+			hcd_count++;
+		}
+
+		total += len[f];
+		last = f;
+	}
+
+	hcd_data = malloc(total + hcd_count);
+	hcd_records = malloc(hcd_count * sizeof(int));
+
+	if (hcd_data == NULL || hcd_records == NULL) {
+		fprintf(stderr, "no memory for %d byte HCD file\n", total);
+		exit(6);
+	}
+
+	for (f = 0, count = 0; f < hcd_files; f++) {
+		if (raw[f] == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < len[f]; i += HCD_RECORD_HDR + raw[f][i + 2]) {
+			if (f != last && is_launch_ram(&raw[f][i])) {
+				continue;
+			}
+
+			hcd_records[count++] = hcd_len;
+
+			hcd_data[hcd_len] = 0x01;
+			memcpy(&hcd_data[hcd_len + 1], &raw[f][i],
+				HCD_RECORD_HDR + raw[f][i + 2]);
+
+			hcd_len += 1 + HCD_RECORD_HDR + raw[f][i + 2];
+		}
+
+		free(raw[f]);
+	}
+
+	hcd_count = count;
+
+	stats.load_ms = now_ms() - start;
+}
+
+static void *
+hcd_loader(void *arg)
+{
+	load_hcd();
+
+	return(NULL);
+}
+
+/*
+** Starts reading the HCD file in the background so that it is in memory
+** by the time the reset, baud rate switch and minidriver are done.
+*/
+void
+hcd_prefetch()
+{
+	if (hcdfile_fd < 0 || hcd_data != NULL || hcd_loading) {
+		return;
+	}
+
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(hcdfile_fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+	if (pthread_create(&hcd_thread, NULL, hcd_loader, NULL) == 0) {
+		hcd_loading = 1;
+	}
+}
+
+/*
+** True if there is anything to download, from --patchram, --firmware_dir
+** or built in.
+*/
+int
+have_patchram()
+{
+#ifdef BRCM_EMBEDDED_FIRMWARE
+	if (embedded_firmware[0].data != NULL) {
+		return(1);
+	}
+#endif
+
+	return(hcdfile_fd > 0 || firmware_dir != NULL);
+}
+
+#ifdef BRCM_EMBEDDED_FIRMWARE
+/*
+** Points the download at the built in firmware for the chip, which is
+** already laid out the way load_hcd() would leave it.
+*/
+static int
+select_embedded()
+{
+	const tEmbeddedFirmware *fw;
+
+	for (fw = embedded_firmware; fw->data != NULL; fw++) {
+		if (fw->chip_id == chip_id) {
+			hcd_data = (uchar *)fw->data;
+			hcd_len = fw->len;
+			hcd_records = (int *)fw->records;
+			hcd_count = fw->count;
+
+			if (debug) {
+				fprintf(stderr, "using built in %s\n", fw->name);
+			}
+
+			return(1);
+		}
+	}
+
+	return(0);
+}
+#endif
+
+/*
+** Sends count H4 command packets from data, found at the offsets listed
+** in records, keeping up to max_outstanding of them in flight within the
+** controller's command credits.  Completions are matched to commands in
+** order by opcode.  Launch_RAM is held back until everything before it
+** has completed.
+**
+** If no completion arrives within record_timeout ms, or a garbled event
+** comes back, the oldest outstanding command and everything sent after
+** it is sent again.  Every Write_RAM completion looks the same, so with
+** several commands in flight a lost one moves the later ones onto the
+** wrong commands; then everything since the last time none were in
+** flight is sent again, one at a time.  A failure status is final: the
+** first lenient commands only get a warning for it, any other stops the
+** run, as does a command that could not be written in full.  Returns -1
+** once all commands have completed, or the index of the command that
+** failed or could not be completed within record_retries attempts.
+**
+** With --duplex the commands are written and the events read by their
+** own threads for as long as this runs.
+*/
+int
+send_commands(uchar *data, int *records, int count, int max_outstanding,
+	int lenient)
+{
+	unsigned int deadline = now_ms() + record_timeout;
+	int completed = 0;
+	int failed = -1;
+	int synced = 0;
+	int tries = 0;
+	int sent = 0;
+	int timeout;
+	int opcode;
+	int status;
+	int len;
+	uchar *cmd;
+
+	duplex_start();
+
+	while (completed < count) {
+		if (max_outstanding > 1 && phase_over()) {
+			max_outstanding = 1;
+		}
+
+		if (sent < count && sent - completed < max_outstanding &&
+			__atomic_load_n(&credits, __ATOMIC_RELAXED) > 0 &&
+			(sent == completed ||
+			!is_launch_ram(&data[records[sent]] + 1))) {
+			cmd = &data[records[sent++]];
+
+			/*
+			** The controller would take whatever comes next as the
+			** rest of a command cut short, only a reset gets it back.
+			*/
+			if (hci_send_cmd(cmd, 1 + HCD_RECORD_HDR + cmd[3]) < 0) {
+				failed = sent - 1;
+				break;
+			}
+
+			__atomic_sub_fetch(&credits, 1, __ATOMIC_RELAXED);
+
+			if (sent - completed == 1) {
+				deadline = now_ms() + record_timeout;
+			}
+
+			if (sent - completed > stats.max_outstanding) {
+				stats.max_outstanding = sent - completed;
+			}
+
+			continue;
+		}
+
+		timeout = -1;
+
+		if (record_timeout > 0) {
+			timeout = deadline - now_ms();
+
+			if (timeout < 0 || timeout > record_timeout) {
+				timeout = 0;
+			}
+		}
+
+		len = read_event_timeout(buffer, timeout);
+
+		if (len == 0) {
+			stats.timeouts++;
+		} else if (buffer[0] != HCIT_TYPE_EVENT || len < 3) {
+			stats.bad_events++;
+		} else if (buffer[1] == HCI_EV_CMD_COMPLETE ||
+			buffer[1] == HCI_EV_CMD_STATUS) {
+			if (buffer[1] == HCI_EV_CMD_COMPLETE) {
+				opcode = buffer[4] | (buffer[5] << 8);
+				status = buffer[6];
+			} else {
+				opcode = buffer[5] | (buffer[6] << 8);
+				status = buffer[3];
+			}
+
+			cmd = &data[records[completed]];
+
+			if (completed >= sent ||
+				opcode != (cmd[1] | (cmd[2] << 8))) {
+				continue;
+			}
+
+			if (status != 0 && completed < lenient) {
+				fprintf(stderr, "command %02x%02x failed with status %02x, "
+					"ignored\n", cmd[2], cmd[1], status);
+			} else if (status != 0) {
+				/* sending it again would only get the same answer */
+				stats.bad_events++;
+				failed = completed;
+				break;
+			}
+
+			if (++completed == sent) {
+				synced = completed;
+			}
+
+			tries = 0;
+			deadline = now_ms() + record_timeout;
+			continue;
+		} else {
+			continue;
+		}
+
+		if (++tries > record_retries) {
+			failed = completed;
+			break;
+		}
+
+		if (sent - synced > 1) {
+			completed = synced;
+			max_outstanding = 1;
+		}
+
+		if (debug) {
+			fprintf(stderr, "retrying command %d of %d\n",
+				completed + 1, count);
+		}
+
+		stats.retries++;
+
+		if (transport->flush) {
+			transport->flush();
+		}
+
+		sent = completed;
+		__atomic_store_n(&credits, 1, __ATOMIC_RELAXED);
+	}
+
+	duplex_stop();
+
+	return(failed);
+}
+
+static void
+proc_minidriver()
+{
+	unsigned int start = now_ms();
+
+	hci_send_cmd_or_exit(hci_download_minidriver,
+		sizeof(hci_download_minidriver));
+
+	read_event(buffer);
+
+	if (!no2bytes && transport->read_bytes) {
+		if (transport->read_bytes(&buffer[0], 2, deadline_clamp(-1)) < 2) {
+			deadline_check();
+		}
+	}
+
+	if (tosleep) {
+		usleep(tosleep);
+	}
+
+	stats.minidriver_ms += now_ms() - start;
+}
+
+void
+proc_patchram()
+{
+	unsigned long long wait;
+	unsigned int start;
+	int failed;
+	uchar *cmd;
+
+	phase_start(PHASE_DOWNLOAD);
+
+	proc_read_chip_id();
+
+	if (hcdfile_fd < 0 && firmware_dir != NULL && firmware_select() == 0) {
+		hcd_prefetch();
+	}
+
+#ifdef BRCM_EMBEDDED_FIRMWARE
+	if (hcdfile_fd < 0) {
+		select_embedded();
+	}
+#endif
+
+	/* a download was asked for, going on without one is no success */
+	if (hcdfile_fd < 0 && hcd_data == NULL) {
+		fprintf(stderr, "no firmware for chip %02x\n", chip_id);
+		exit(11);
+	}
+
+	proc_minidriver();
+
+	start = now_ms();
+
+	if (hcd_loading) {
+		pthread_join(hcd_thread, NULL);
+		hcd_loading = 0;
+	} else if (hcd_data == NULL) {
+		load_hcd();
+	}
+
+	stats.load_wait_ms = now_ms() - start;
+
+	start = now_ms();
+	wait = sched_wait_us();
+
+	/*
+	** Records that keep failing are only recovered by starting over
+	** from a fresh reset and minidriver, once.
+	*/
+	while ((failed = stream ?
+		stream_commands(hcd_data, hcd_records, hcd_count) :
+		send_commands(hcd_data, hcd_records, hcd_count, window, 0)) >= 0) {
+		cmd = &hcd_data[hcd_records[failed]];
+
+		if (stats.restarts) {
+			fprintf(stderr, "patchram record %d (%02x%02x) failed\n",
+				failed, cmd[2], cmd[1]);
+			exit(8);
+		}
+
+		fprintf(stderr, "patchram record %d failed, restarting download\n",
+			failed);
+
+		stats.restarts++;
+
+		/*
+		** Nothing left over from the failed attempt may be taken for
+		** the answer to the reset.  The restarted download runs at the
+		** default rate.
+		*/
+		if (transport->flush) {
+			transport->flush();
+		}
+
+		launch_at_speed = 0;
+
+		if (transport->default_speed) {
+			transport->default_speed();
+		}
+
+		proc_reset();
+		proc_minidriver();
+	}
+
+	stats.records = hcd_count;
+	stats.bytes = hcd_len;
+	stats.download_ms = now_ms() - start;
+	stats.download_wait_us = sched_wait_us() - wait;
+
+	start = now_ms();
+
+	proc_launch_reset();
+
+	stats.launch_ms = now_ms() - start;
+}
+
+void
+engine_report()
+{
+	fprintf(stderr, "%s: %d commands, %d events, %d resets\n",
+		transport->name, stats.commands, stats.events, stats.resets);
+	fprintf(stderr, "reset %u ms, minidriver %u ms, launch %u ms\n",
+		stats.reset_ms, stats.minidriver_ms, stats.launch_ms);
+	fprintf(stderr, "HCD load %u ms, %u ms of it not overlapped\n",
+		stats.load_ms, stats.load_wait_ms);
+	fprintf(stderr, "download %d records, %d bytes in %u ms, window %d\n",
+		stats.records, stats.bytes, stats.download_ms,
+		stats.max_outstanding);
+	fprintf(stderr, "waited %u us for a CPU during the download%s\n",
+		stats.download_wait_us, realtime_priority ? ", realtime" : "");
+	fprintf(stderr, "blocked %u us on flow control, %d partial writes, "
+		"%d failed\n", stats.tx_blocked_us, stats.tx_partial,
+		stats.tx_failed);
+	fprintf(stderr, "%u us draining %d queued bytes before speed changes\n",
+		stats.drain_us, stats.drain_bytes);
+	fprintf(stderr, "%d timeouts, %d bad events, %d retries, %d restarts\n",
+		stats.timeouts, stats.bad_events, stats.retries, stats.restarts);
+	fprintf(stderr, "config %d commands in %u ms\n",
+		stats.config_commands, stats.config_ms);
+
+	if (log_dropped) {
+		fprintf(stderr, "%d packets not logged\n", log_dropped);
+	}
+
+	if (io_uring) {
+		uring_report();
+	}
+
+	if (deadline) {
+		deadline_report();
+	}
+
+	if (stream) {
+		stream_report();
+	}
+}
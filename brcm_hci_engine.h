@@ -0,0 +1,289 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_engine.h
+**
+**  Description:   Transport independent HCD download engine shared by
+**                 brcm_patchram_plus, brcm_patchram_plus_h5 and
+**                 brcm_patchram_plus_usb.
+**
+**                 Each program registers an HCI transport (UART H4,
+**                 UART H5 or a BlueZ HCI socket) and then uses the same
+**                 reset, minidriver, download and event handling code.
+**
+******************************************************************************/
+
+#ifndef BRCM_HCI_ENGINE_H
+#define BRCM_HCI_ENGINE_H
+
+typedef unsigned char uchar;
+
+/*
+** All packets handed to and returned from a transport are in H4 form,
+** i.e. prefixed with the HCI packet type (0x01 command, 0x04 event).
+**
+** read_event returns the length of the event, 0 if timeout_ms expired
+** (a negative timeout_ms waits forever) or -1 on an I/O error.
+** read_bytes is optional and only used for the raw two byte minidriver
+** confirmation some older chips send on UART links.
+** default_speed is optional and is called just before the post download
+** reset, when the controller falls back to its power-on line settings.
+** flush is optional, lets anything still queued for sending go out and
+** discards any received data not yet read, so that a command can be
+** retried from a clean state.
+** fd is optional and points to the descriptor events are read from, for
+** code that has to wait on it together with something else.
+*/
+typedef struct {
+	const char *name;
+	int (*send)(uchar *buf, int len);
+	int (*read_event)(uchar *buf, int size, int timeout_ms);
+	int (*read_bytes)(uchar *buf, int len, int timeout_ms);
+	void (*default_speed)(void);
+	void (*flush)(void);
+	int *fd;
+} tHciTransport;
+
+typedef struct {
+	int commands;
+	int events;
+	int records;
+	int bytes;
+	int resets;
+	int max_outstanding;
+	int timeouts;
+	int bad_events;
+	int retries;
+	int restarts;
+	unsigned int reset_ms;
+	unsigned int minidriver_ms;
+	unsigned int download_ms;
+	unsigned int launch_ms;
+	unsigned int load_ms;
+	unsigned int load_wait_ms;
+	int config_commands;
+	unsigned int config_ms;
+	unsigned int download_wait_us;
+	unsigned int tx_blocked_us;
+	int tx_partial;
+	int tx_failed;
+	unsigned int drain_us;
+	int drain_bytes;
+} tEngineStats;
+
+/* firmware built in with make FIRMWARE=chip_id=file, see brcm_hcd2c */
+typedef struct {
+	int chip_id;
+	const char *name;
+	const uchar *data;
+	int len;
+	const int *records;
+	int count;
+} tEmbeddedFirmware;
+
+#define HCI_RESET_TIMEOUT_MS	4000
+#define HCI_RECORD_TIMEOUT_MS	1000
+#define HCI_LAUNCH_TIMEOUT_MS	100
+
+#define HCIT_TYPE_EVENT		0x04
+
+#define HCI_EV_CMD_COMPLETE	0x0e
+#define HCI_EV_CMD_STATUS	0x0f
+
+/* opcode (2 bytes, little endian) and parameter length */
+#define HCD_RECORD_HDR		3
+#define HCD_MAX_FILES		8
+
+#define HCI_LAUNCH_RAM		0xfc4e
+
+#define CHIP_ID_4330B2 0x43
+#define CHIP_ID_4329B1 0x29
+
+extern tHciTransport *transport;
+extern tEngineStats stats;
+
+extern int debug;
+extern int hcdfile_fd;
+extern int no2bytes;
+extern int tosleep;
+extern int baud_settle;
+extern int window;
+extern int record_timeout;
+extern int record_retries;
+extern uchar chip_id;
+extern int launch_at_speed;
+extern int launch_keeps_speed;
+extern int launch_learn;
+
+extern uchar buffer[1024];
+
+extern uchar hci_reset[4];
+extern uchar hci_download_minidriver[4];
+extern uchar hci_read_verbose_config_version_info[4];
+
+/* levels for debug, -d is DEBUG_PACKETS */
+#define DEBUG_MESSAGES		1
+#define DEBUG_PACKETS		2
+
+#ifdef BRCM_NO_DEBUG_LOG
+#define debug_log	0
+#else
+#define debug_log	(debug >= DEBUG_PACKETS)
+#endif
+
+extern int log_rate;
+extern int log_dropped;
+
+unsigned int now_ms();
+unsigned long long now_us();
+
+int parse_log_rate(char *optarg);
+int parse_log_level(char *optarg);
+void log_packet(const char *what, uchar *buf, int len);
+
+int parse_patchram(char *optarg);
+int parse_window(char *optarg);
+int parse_record_timeout(char *optarg);
+int parse_record_retries(char *optarg);
+int parse_launch_keeps_baudrate(char *optarg);
+
+void hcd_prefetch();
+int have_patchram();
+
+extern char *firmware_dir;
+extern unsigned long long firmware_digest;
+
+int parse_firmware_dir(char *optarg);
+int firmware_select();
+unsigned long long hcd_digest(uchar *data, int len);
+
+extern const tEmbeddedFirmware embedded_firmware[];
+
+int hci_send_cmd(uchar *buf, int len);
+void hci_send_cmd_or_exit(uchar *buf, int len);
+int read_event(uchar *buf);
+int read_event_timeout(uchar *buf, int timeout_ms);
+
+int send_commands(uchar *data, int *records, int count,
+	int max_outstanding, int lenient);
+
+int wait_reset(int timeout_ms);
+void proc_reset();
+void proc_read_chip_id();
+void proc_patchram();
+
+void engine_report();
+
+void config_add(uchar *cmd, int len);
+int parse_script(char *optarg);
+void proc_config();
+
+#define PHASE_RESET		0
+#define PHASE_BAUD		1
+#define PHASE_DOWNLOAD		2
+#define PHASE_CONFIG		3
+
+extern int deadline;
+
+int parse_deadline(char *optarg);
+void phase_start(int next);
+int phase_timeout();
+int phase_over();
+int deadline_clamp(int timeout_ms);
+void deadline_check();
+void deadline_report();
+
+/*
+** make tiny leaves the following modules out, the engine and the tool
+** then see them as never enabled.
+*/
+#ifndef BRCM_TINY
+int parse_tune(char *optarg);
+void tune_load(char *device);
+void tune_chip();
+void tune_save();
+
+extern int btsnoop_fd;
+
+int parse_btsnoop(char *optarg);
+void btsnoop_log(uchar *buf, int len, int received);
+
+extern int duplex;
+
+int parse_duplex(char *optarg);
+void duplex_start();
+void duplex_stop();
+
+extern int io_uring;
+
+int parse_io_uring(char *optarg);
+void uring_start(int fd);
+void uring_stop();
+void uring_report();
+
+extern int stream;
+
+int parse_stream(char *optarg);
+int stream_commands(uchar *data, int *records, int count);
+void stream_report();
+
+extern int ready_fd;
+extern int detach;
+
+int parse_ready_fd(char *optarg);
+int parse_detach(char *optarg);
+void notify_ready();
+
+extern char *pass_fd_path;
+extern int fdstore;
+
+int parse_pass_fd(char *optarg);
+int parse_fdstore(char *optarg);
+int handoff_fd(int fd, char *name);
+
+extern int realtime_priority;
+extern int realtime_cpu;
+
+int parse_realtime(char *optarg);
+void realtime_start();
+unsigned long long sched_wait_us();
+#else
+#define tune_load(device)
+#define tune_chip()
+#define tune_save()
+#define btsnoop_fd		(-1)
+#define btsnoop_log(buf, len, received)
+#define duplex_start()
+#define duplex_stop()
+#define io_uring		0
+#define uring_start(fd)
+#define uring_stop()
+#define uring_report()
+#define stream			0
+#define stream_commands(data, records, count)	(-1)
+#define stream_report()
+#define notify_ready()
+#define handoff_fd(fd, name)	0
+#define realtime_priority	0
+#define realtime_start()
+#define sched_wait_us()		0ULL
+#endif
+
+#endif
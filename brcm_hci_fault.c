@@ -0,0 +1,522 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_fault.c
+**
+**  Description:   This program sits between brcm_patchram_plus and a
+**                 controller, normally brcm_hci_replay on a pseudo
+**                 terminal, and injects faults into the H4 traffic to
+**                 measure how quickly the program under test notices
+**                 them and gets going again.
+**
+**                 It can be invoked from the command line in the form
+**						<-d> to print a debug log
+**						<--drop=n to lose event n>
+**						<--lose=n to lose the last byte of event n>
+**						<--dup=n to send event n twice>
+**						<--corrupt=n to flip the event code of event n>
+**						<--delay=n to hold event n back>
+**						<--stall=n to stop taking commands when event n
+**							arrives, as if RTS had been dropped>
+**						<--spurious=n to send a vendor event ahead of
+**							event n>
+**						<--hold=ms that delay and stall last, default 2000>
+**						<--recover=number of clean command and event
+**							pairs that count as recovered, default 3>
+**						controller_device
+**						command [args]
+**
+**                 Events are numbered from 1 in the order the controller
+**                 sends them, and each fault option may be given several
+**                 times.  Any "{}" in the command arguments is replaced by
+**                 the name of the pseudo terminal the command should use.
+**
+**                 For example:
+**
+**                 brcm_hci_replay bcm4329.btsnoop
+**                 brcm_hci_fault --drop=40 --corrupt=90 /dev/pts/3 \
+**						brcm_patchram_plus --no2bytes \
+**						--patchram BCM4329B1.hcd {}
+**
+**                 For every fault it prints how long it took the command
+**                 to react, that is to send anything, and to recover,
+**                 that is to get --recover commands answered in a row.
+**                 It returns the exit status of the command.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef ANDROID
+#include <termios.h>
+#else
+#include <sys/termios.h>
+#endif
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_hci_fault"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+typedef unsigned char uchar;
+
+#define MAX_FAULTS		32
+#define MAX_QUEUED		1024
+
+enum {
+	FAULT_DROP,
+	FAULT_LOSE,
+	FAULT_DUP,
+	FAULT_CORRUPT,
+	FAULT_DELAY,
+	FAULT_STALL,
+	FAULT_SPURIOUS
+};
+
+char *fault_names[] = {
+	"drop", "lose", "dup", "corrupt", "delay", "stall", "spurious"
+};
+
+typedef struct {
+	int kind;
+	int event;
+	unsigned long long injected;
+	unsigned long long reacted;
+	unsigned long long recovered;
+	int clean;
+} tFault;
+
+typedef struct {
+	unsigned long long due;
+	int len;
+	uchar data[260];
+} tQueued;
+
+int debug = 0;
+int hold = 2000;
+int recover = 3;
+
+tFault faults[MAX_FAULTS];
+int fault_count = 0;
+
+tQueued queue[MAX_QUEUED];
+int queue_count = 0;
+
+int host_fd = -1;
+int ctrl_fd = -1;
+
+int events = 0;
+int last_opcode = -1;
+unsigned long long stalled_until = 0;
+
+uchar spurious[] = { 0x04, 0xff, 0x02, 0x00, 0x00 };
+
+unsigned long long
+now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void
+set_raw(int fd)
+{
+	struct termios termios;
+
+	tcgetattr(fd, &termios);
+	cfmakeraw(&termios);
+	tcsetattr(fd, TCSANOW, &termios);
+}
+
+/*
+** Queues bytes for the host.  They go out in order, so anything queued
+** behind a delayed event waits for it.
+*/
+void
+to_host(uchar *data, int len, unsigned long long due)
+{
+	if (queue_count == MAX_QUEUED) {
+		fprintf(stderr, "too many events queued for the host\n");
+		exit(4);
+	}
+
+	if (queue_count && due < queue[queue_count - 1].due) {
+		due = queue[queue_count - 1].due;
+	}
+
+	queue[queue_count].due = due;
+	queue[queue_count].len = len;
+	memcpy(queue[queue_count].data, data, len);
+	queue_count++;
+}
+
+void
+flush_host(unsigned long long now)
+{
+	int i = 0;
+
+	while (i < queue_count && queue[i].due <= now) {
+		write(host_fd, queue[i].data, queue[i].len);
+		i++;
+	}
+
+	memmove(&queue[0], &queue[i], (queue_count - i) * sizeof(tQueued));
+	queue_count -= i;
+}
+
+/*
+** Counts a command answered with its own opcode towards the recovery of
+** every fault still outstanding.
+*/
+void
+proc_clean(uchar *event, unsigned long long now)
+{
+	int opcode;
+	int i;
+
+	if (event[1] == 0x0e && event[2] >= 3) {
+		opcode = event[4] | (event[5] << 8);
+	} else if (event[1] == 0x0f && event[2] >= 4) {
+		opcode = event[5] | (event[6] << 8);
+	} else {
+		return;
+	}
+
+	for (i = 0; i < fault_count; i++) {
+		if (faults[i].injected && !faults[i].recovered &&
+			faults[i].reacted) {
+			if (opcode == last_opcode && ++faults[i].clean == recover) {
+				faults[i].recovered = now;
+			} else if (opcode != last_opcode) {
+				faults[i].clean = 0;
+			}
+		}
+	}
+}
+
+void
+proc_event(uchar *event, int len, unsigned long long now)
+{
+	unsigned long long due = now;
+	int forward = 1;
+	int i;
+
+	events++;
+
+	for (i = 0; i < fault_count; i++) {
+		if (faults[i].event != events) {
+			continue;
+		}
+
+		faults[i].injected = now;
+
+		if (debug) {
+			fprintf(stderr, "%s at event %d\n",
+				fault_names[faults[i].kind], events);
+		}
+
+		switch (faults[i].kind) {
+			case FAULT_DROP:
+				forward = 0;
+				break;
+			case FAULT_LOSE:
+				len--;
+				break;
+			case FAULT_DUP:
+				to_host(event, len, due);
+				break;
+			case FAULT_CORRUPT:
+				event[1] ^= 0x5a;
+				break;
+			case FAULT_DELAY:
+				due = now + hold * 1000ULL;
+				break;
+			case FAULT_STALL:
+				stalled_until = now + hold * 1000ULL;
+				break;
+			case FAULT_SPURIOUS:
+				to_host(spurious, sizeof(spurious), due);
+				break;
+		}
+	}
+
+	if (forward) {
+		to_host(event, len, due);
+		proc_clean(event, now);
+	}
+}
+
+void
+proc_host(uchar *data, int len, unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < fault_count; i++) {
+		if (faults[i].injected && !faults[i].reacted &&
+			now >= faults[i].injected) {
+			faults[i].reacted = now;
+		}
+	}
+
+	if (len >= 3 && data[0] == 0x01) {
+		last_opcode = data[1] | (data[2] << 8);
+	}
+
+	write(ctrl_fd, data, len);
+}
+
+int
+add_fault(int kind, char *optarg)
+{
+	if (fault_count == MAX_FAULTS) {
+		fprintf(stderr, "too many faults\n");
+		return(1);
+	}
+
+	faults[fault_count].kind = kind;
+	faults[fault_count].event = atoi(optarg);
+	fault_count++;
+
+	return(0);
+}
+
+void
+usage(char *argv0)
+{
+	printf("Usage %s:\n", argv0);
+	printf("\t<-d> to print a debug log\n");
+	printf("\t<--drop=n> <--lose=n> <--dup=n> <--corrupt=n>\n");
+	printf("\t<--delay=n> <--stall=n> <--spurious=n>\n");
+	printf("\t<--hold=ms>\n");
+	printf("\t<--recover=commands>\n");
+	printf("\tcontroller_device\n");
+	printf("\tcommand [args], {} is replaced by the pseudo terminal\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"drop", 1, 0, 0},
+		{"lose", 1, 0, 0},
+		{"dup", 1, 0, 0},
+		{"corrupt", 1, 0, 0},
+		{"delay", 1, 0, 0},
+		{"stall", 1, 0, 0},
+		{"spurious", 1, 0, 0},
+		{"hold", 1, 0, 0},
+		{"recover", 1, 0, 0},
+		{0, 0, 0, 0}
+	};
+	struct pollfd pfd[2];
+	unsigned long long start;
+	unsigned long long now;
+	uchar ctrl[4096];
+	uchar host[4096];
+	int ctrl_len = 0;
+	int option_index;
+	int status = 0;
+	int timeout;
+	int count;
+	int c;
+	int i;
+	pid_t pid;
+	char *pty;
+
+	while ((c = getopt_long_only(argc, argv, "+d", long_options,
+		&option_index)) != -1) {
+		switch (c) {
+			case 0:
+				if (option_index <= FAULT_SPURIOUS) {
+					if (add_fault(option_index, optarg)) {
+						exit(1);
+					}
+				} else if (strcmp(long_options[option_index].name,
+					"hold") == 0) {
+					hold = atoi(optarg);
+				} else {
+					recover = atoi(optarg);
+				}
+				break;
+			case 'd':
+				debug = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	if (optind + 1 >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if ((ctrl_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
+		fprintf(stderr, "controller %s could not be opened, error %d\n",
+			argv[optind], errno);
+		exit(2);
+	}
+
+	set_raw(ctrl_fd);
+	optind++;
+
+	if ((host_fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+		grantpt(host_fd) || unlockpt(host_fd) ||
+		(pty = ptsname(host_fd)) == NULL) {
+		fprintf(stderr, "pseudo terminal could not be opened, error %d\n",
+			errno);
+		exit(3);
+	}
+
+	set_raw(host_fd);
+
+	for (i = optind; i < argc; i++) {
+		if (strcmp(argv[i], "{}") == 0) {
+			argv[i] = pty;
+		}
+	}
+
+	start = now_us();
+
+	if ((pid = fork()) == 0) {
+		execvp(argv[optind], &argv[optind]);
+		fprintf(stderr, "%s could not be run, error %d\n",
+			argv[optind], errno);
+		exit(127);
+	}
+
+	pfd[0].fd = host_fd;
+	pfd[1].fd = ctrl_fd;
+	pfd[1].events = POLLIN;
+
+	while (waitpid(pid, &status, WNOHANG) != pid) {
+		now = now_us();
+
+		flush_host(now);
+
+		timeout = 100;
+
+		if (queue_count && (queue[0].due - now) / 1000 < timeout) {
+			timeout = (queue[0].due - now) / 1000;
+		}
+
+		if (stalled_until > now) {
+			pfd[0].events = 0;
+
+			if ((stalled_until - now) / 1000 < timeout) {
+				timeout = (stalled_until - now) / 1000 + 1;
+			}
+		} else {
+			pfd[0].events = POLLIN;
+		}
+
+		if (poll(pfd, 2, timeout) <= 0) {
+			continue;
+		}
+
+		now = now_us();
+
+		if (pfd[0].revents & POLLHUP) {
+			usleep(1000);
+		} else if (pfd[0].revents & POLLIN) {
+			if ((count = read(host_fd, host, sizeof(host))) > 0) {
+				proc_host(host, count, now);
+			}
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			count = read(ctrl_fd, &ctrl[ctrl_len],
+				sizeof(ctrl) - ctrl_len);
+
+			if (count <= 0) {
+				fprintf(stderr, "controller went away\n");
+				break;
+			}
+
+			ctrl_len += count;
+		}
+
+		/* anything that is not an event, such as the two bytes after the
+		   minidriver, goes through untouched */
+		while (ctrl_len) {
+			if (ctrl[0] != 0x04) {
+				to_host(ctrl, 1, now);
+				memmove(ctrl, &ctrl[1], --ctrl_len);
+				continue;
+			}
+
+			if (ctrl_len < 3 || ctrl_len < 3 + ctrl[2]) {
+				break;
+			}
+
+			count = 3 + ctrl[2];
+			proc_event(ctrl, count, now);
+			memmove(ctrl, &ctrl[count], ctrl_len - count);
+			ctrl_len -= count;
+		}
+	}
+
+	fprintf(stderr, "%llu ms, %d events\n", (now_us() - start) / 1000,
+		events);
+
+	for (i = 0; i < fault_count; i++) {
+		fprintf(stderr, "%s at event %d: ", fault_names[faults[i].kind],
+			faults[i].event);
+
+		if (!faults[i].injected) {
+			fprintf(stderr, "not reached\n");
+		} else if (!faults[i].reacted) {
+			fprintf(stderr, "never reacted\n");
+		} else if (!faults[i].recovered) {
+			fprintf(stderr, "reacted in %llu ms, not recovered\n",
+				(faults[i].reacted - faults[i].injected) / 1000);
+		} else {
+			fprintf(stderr, "reacted in %llu ms, recovered in %llu ms\n",
+				(faults[i].reacted - faults[i].injected) / 1000,
+				(faults[i].recovered - faults[i].injected) / 1000);
+		}
+	}
+
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
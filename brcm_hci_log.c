@@ -0,0 +1,145 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_log.c
+**
+**  Description:   Debug logging of HCI packets.
+**
+**                 Each packet is formatted into a single buffer and
+**                 written with one call, so that on Android it becomes one
+**                 log entry instead of one per byte.  At most log_rate
+**                 packets are logged per second (0 for no limit); the
+**                 number of packets left out is logged with the next one
+**                 and their total is given in the report.  The counters
+**                 are atomic, as with --stream packets are logged from
+**                 both the writer and the receiver thread.
+**
+**                 --log_level sets how much -d shows: 0 only errors, 1
+**                 progress messages and the report, 2 the HCI packets as
+**                 well, which is what -d alone gives.
+**
+**                 Building with BRCM_NO_DEBUG_LOG defined removes packet
+**                 logging from the I/O path altogether.
+**
+******************************************************************************/
+
+#include <stdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define LOG_MAX_BYTES	1024
+
+int log_rate = 100;
+int log_dropped = 0;
+
+static unsigned int log_second = 0;
+static int log_count = 0;
+static int log_pending = 0;
+
+static const char hex[] = "0123456789abcdef";
+
+int
+parse_log_rate(char *optarg)
+{
+	log_rate = atoi(optarg);
+
+	if (log_rate < 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_log_level(char *optarg)
+{
+	debug = atoi(optarg);
+
+	if (debug < 0 || debug > DEBUG_PACKETS) {
+		return(1);
+	}
+
+	return(0);
+}
+
+void
+log_packet(const char *what, uchar *buf, int len)
+{
+	char line[64 + LOG_MAX_BYTES * 3 + LOG_MAX_BYTES / 16];
+	unsigned int second;
+	unsigned int last;
+	char *p = line;
+	int pending;
+	int i;
+
+	if (log_rate) {
+		second = now_ms() / 1000;
+		last = __atomic_load_n(&log_second, __ATOMIC_RELAXED);
+
+		if (second != last && __atomic_compare_exchange_n(&log_second,
+			&last, second, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&log_count, 0, __ATOMIC_RELAXED);
+		}
+
+		if (__atomic_fetch_add(&log_count, 1, __ATOMIC_RELAXED) >=
+			log_rate) {
+			__atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&log_pending, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	if ((pending = __atomic_exchange_n(&log_pending, 0, __ATOMIC_RELAXED))) {
+		p += sprintf(p, "(%d packets not logged)\n", pending);
+	}
+
+	p += sprintf(p, "%s %d\n", what, len);
+
+	if (len > LOG_MAX_BYTES) {
+		len = LOG_MAX_BYTES;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (i && !(i % 16)) {
+			*p++ = '\n';
+		}
+
+		*p++ = hex[buf[i] >> 4];
+		*p++ = hex[buf[i] & 0x0f];
+		*p++ = ' ';
+	}
+
+	*p = '\0';
+
+	fprintf(stderr, "%s\n", line);
+}
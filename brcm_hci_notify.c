@@ -0,0 +1,317 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_notify.c
+**
+**  Description:   Readiness notification once the line discipline is
+**                 attached, and handing the port to another process.
+**
+**                 If $NOTIFY_SOCKET is set, READY=1 is sent to it the way
+**                 sd_notify() does, as a datagram to that Unix socket, a
+**                 leading @ naming an abstract one.  With --ready_fd=n
+**                 the same text is also written to descriptor n, which
+**                 is then closed, so a parent can wait for it on a pipe.
+**
+**                 With --detach the program forks at that point and the
+**                 parent exits with 0 once the child, which keeps the
+**                 port open, has sent the notification.  A caller of
+**                 system(2) then returns as soon as Bluetooth is up.  If
+**                 the child dies first the parent exits with its status.
+**
+**                 With --pass_fd=path the configured port is sent
+**                 instead, with SCM_RIGHTS, to the HCI stack listening
+**                 on that Unix socket, together with DEVICE=name.  With
+**                 --fdstore it goes to the service manager's descriptor
+**                 store through $NOTIFY_SOCKET as FDSTORE=1.  Either way
+**                 the tty is never closed, so its speed and termios
+**                 settings stay as the download left them.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+int ready_fd = -1;
+int detach = 0;
+char *pass_fd_path = NULL;
+int fdstore = 0;
+
+int
+parse_ready_fd(char *optarg)
+{
+	ready_fd = atoi(optarg);
+
+	if (ready_fd < 0 || fcntl(ready_fd, F_GETFD) == -1) {
+		return(1);
+	}
+
+	return(0);
+}
+
+int
+parse_detach(char *optarg)
+{
+	detach = 1;
+	return(0);
+}
+
+int
+parse_pass_fd(char *optarg)
+{
+	pass_fd_path = optarg;
+	return(0);
+}
+
+int
+parse_fdstore(char *optarg)
+{
+	fdstore = 1;
+	return(0);
+}
+
+/*
+** Sends msg, and fd along with it unless it is -1, to the Unix socket at
+** path.  A datagram socket is tried first, then a stream one.
+*/
+static int
+unix_send(char *path, char *msg, int fd)
+{
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr mh;
+	struct iovec iov;
+	int types[] = { SOCK_DGRAM, SOCK_STREAM };
+	int ret = -1;
+	int len;
+	int s;
+	int i;
+
+	if ((path[0] != '/' && path[0] != '@') ||
+		strlen(path) >= sizeof(addr.sun_path)) {
+		errno = EINVAL;
+		return(-1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	if (path[0] == '@') {
+		addr.sun_path[0] = '\0';
+	} else {
+		len++;
+	}
+
+	iov.iov_base = msg;
+	iov.iov_len = strlen(msg);
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+
+	if (fd >= 0) {
+		memset(&control, 0, sizeof(control));
+		mh.msg_control = control.buf;
+		mh.msg_controllen = sizeof(control.buf);
+
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if ((s = socket(AF_UNIX, types[i], 0)) == -1) {
+			return(-1);
+		}
+
+		if (connect(s, (struct sockaddr *)&addr, len) == 0) {
+			ret = sendmsg(s, &mh, 0);
+			close(s);
+			break;
+		}
+
+		close(s);
+
+		if (errno != EPROTOTYPE) {
+			break;
+		}
+	}
+
+	return(ret);
+}
+
+static void
+notify_socket(char *msg)
+{
+	char *path;
+
+	if ((path = getenv("NOTIFY_SOCKET")) == NULL) {
+		return;
+	}
+
+	if (unix_send(path, msg, -1) == -1) {
+		fprintf(stderr, "%s could not be notified, error %d\n", path, errno);
+	}
+}
+
+/*
+** Called once the controller is handed to the kernel.  Only returns in
+** the process that is to keep the port open.
+*/
+void
+notify_ready()
+{
+	char msg[64];
+	char byte = 0;
+	int done[2];
+	int status;
+	int count;
+	pid_t pid;
+	int fd;
+
+	if (detach) {
+		if (pipe(done) == -1 || (pid = fork()) == -1) {
+			fprintf(stderr, "could not detach, error %d\n", errno);
+			exit(1);
+		}
+
+		if (pid > 0) {
+			close(done[1]);
+
+			while ((count = read(done[0], &byte, 1)) == -1 &&
+				errno == EINTR)
+				;
+
+			if (count == 1) {
+				exit(0);
+			}
+
+			fprintf(stderr, "background process failed before it was "
+				"ready\n");
+
+			if (waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+				WEXITSTATUS(status) != 0) {
+				exit(WEXITSTATUS(status));
+			}
+
+			exit(1);
+		}
+
+		close(done[0]);
+		setsid();
+	}
+
+	snprintf(msg, sizeof(msg), "READY=1\nMAINPID=%d\n", (int)getpid());
+
+	notify_socket(msg);
+
+	if (ready_fd >= 0) {
+		write(ready_fd, msg, strlen(msg));
+		close(ready_fd);
+		ready_fd = -1;
+	}
+
+	if (detach) {
+		write(done[1], &byte, 1);
+		close(done[1]);
+
+		/* let a caller reading our output see the end of it */
+		if ((fd = open("/dev/null", O_RDWR)) != -1) {
+			dup2(fd, 0);
+			dup2(fd, 1);
+			dup2(fd, 2);
+
+			if (fd > 2) {
+				close(fd);
+			}
+		}
+	}
+}
+
+/*
+** Gives the configured port to the process listening on --pass_fd, or to
+** the service manager's store with --fdstore.  Returns 1 once it has
+** been handed off, after which our copy can be closed without the port
+** being closed, or 0 if neither was asked for.
+*/
+int
+handoff_fd(int fd, char *name)
+{
+	char msg[160];
+	char *path;
+
+	if (pass_fd_path) {
+		path = pass_fd_path;
+		snprintf(msg, sizeof(msg), "DEVICE=%s\n", name ? name : "");
+	} else if (fdstore) {
+		if ((path = getenv("NOTIFY_SOCKET")) == NULL) {
+			fprintf(stderr, "--fdstore needs $NOTIFY_SOCKET\n");
+			exit(10);
+		}
+
+		snprintf(msg, sizeof(msg), "FDSTORE=1\nFDNAME=brcm_uart\n");
+	} else {
+		return(0);
+	}
+
+	if (unix_send(path, msg, fd) == -1) {
+		fprintf(stderr, "port could not be handed to %s, error %d\n", path,
+			errno);
+		exit(10);
+	}
+
+	if (debug) {
+		fprintf(stderr, "port handed to %s\n", path);
+	}
+
+	close(fd);
+
+	return(1);
+}
@@ -0,0 +1,145 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_realtime.c
+**
+**  Description:   Real time scheduling for the I/O thread.
+**
+**                 With --realtime=priority[,cpu] all memory, including
+**                 the firmware image and the I/O buffers, is locked, and
+**                 the thread that talks to the controller is moved to
+**                 SCHED_FIFO at the given priority and optionally pinned
+**                 to one CPU.  Threads it starts afterwards inherit this,
+**                 the HCD loader and the btsnoop writer do not.
+**
+**                 The time the I/O thread spends waiting for a CPU is
+**                 taken from the kernel's schedstat, so runs with and
+**                 without --realtime can be compared.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+int realtime_priority = 0;
+int realtime_cpu = -1;
+
+int
+parse_realtime(char *optarg)
+{
+	char *p;
+
+	realtime_priority = atoi(optarg);
+
+	if (realtime_priority < sched_get_priority_min(SCHED_FIFO) ||
+		realtime_priority > sched_get_priority_max(SCHED_FIFO)) {
+		return(1);
+	}
+
+	if ((p = strchr(optarg, ',')) != NULL) {
+		realtime_cpu = atoi(p + 1);
+
+		if (realtime_cpu < 0 || realtime_cpu >= CPU_SETSIZE) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+void
+realtime_start()
+{
+	struct sched_param param;
+	cpu_set_t cpus;
+
+	if (!realtime_priority) {
+		return;
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		fprintf(stderr, "memory could not be locked, error %d\n", errno);
+	}
+
+	if (realtime_cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(realtime_cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			fprintf(stderr, "could not be pinned to cpu %d, error %d\n",
+				realtime_cpu, errno);
+		}
+	}
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = realtime_priority;
+
+	if ((errno = pthread_setschedparam(pthread_self(), SCHED_FIFO,
+		&param)) != 0) {
+		fprintf(stderr, "SCHED_FIFO could not be set, error %d\n", errno);
+	}
+}
+
+/*
+** Microseconds this thread has spent runnable but waiting for a CPU, or
+** 0 if the kernel does not keep schedstats.
+*/
+unsigned long long
+sched_wait_us()
+{
+	unsigned long long run;
+	unsigned long long wait = 0;
+	FILE *fp;
+
+	if ((fp = fopen("/proc/thread-self/schedstat", "r")) == NULL) {
+		return(0);
+	}
+
+	if (fscanf(fp, "%llu %llu", &run, &wait) != 2) {
+		wait = 0;
+	}
+
+	fclose(fp);
+
+	return(wait / 1000);
+}
@@ -0,0 +1,518 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_replay.c
+**
+**  Description:   This program plays back the controller side of a
+**                 recorded HCI session over a pseudo terminal, so that
+**                 brcm_patchram_plus and brcm_patchram_plus_h5 can be
+**                 benchmarked against the timing of a real chip.
+**
+**                 The session is a btsnoop file as written by --btsnoop.
+**                 Each Command Complete or Command Status in the trace
+**                 belongs to the oldest command before it with the same
+**                 opcode that has not been answered yet, and any other
+**                 event to the command just before it, so that a trace
+**                 recorded with --window keeps its pairs.  Every command
+**                 the program under test sends is matched with the next
+**                 unmatched command in the trace with its opcode, within
+**                 REPLAY_WINDOW commands, and the events that belong to
+**                 that command are sent back after the same delay they
+**                 had on the real controller.
+**
+**                 It can be invoked from the command line in the form
+**						<-d> to print a debug log
+**						<--scale=percent of the recorded latencies to
+**							apply.  Default is 100.>
+**						trace_file
+**						<command [args]>
+**
+**                 Any "{}" in the command arguments is replaced by the
+**                 name of the pseudo terminal.  Without a command the
+**                 name is printed and the trace is replayed to whatever
+**                 opens it.
+**
+**                 For example:
+**
+**                 brcm_hci_replay bcm4329.btsnoop brcm_patchram_plus \
+**						--no2bytes --patchram BCM4329B1.hcd {}
+**
+**                 The two bytes some minidrivers send after their command
+**                 complete are not part of a btsnoop trace, so the program
+**                 under test needs --no2bytes unless the trace is from a
+**                 4330B2.
+**
+**                 It returns the exit status of the command, and prints
+**                 the time it took along with how closely it followed
+**                 the trace.  The time from starting the command to its
+**                 first byte on the line is printed too, as a measure of
+**                 the cost of exec and dynamic loading.
+**
+******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#ifdef ANDROID
+#include <termios.h>
+#else
+#include <sys/termios.h>
+#endif
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_hci_replay"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+typedef unsigned char uchar;
+
+/* how far ahead in the trace a command is looked for */
+#define REPLAY_WINDOW	16
+
+typedef struct {
+	unsigned long long ts;
+	int received;
+	int len;
+	int owner;		/* event: the command it belongs to, or -1 */
+	int events;		/* command: how many events belong to it */
+	int answered;	/* command: its Command Complete or Status was seen */
+	int matched;	/* command: the program under test has sent it */
+	uchar *data;
+} tTraceRecord;
+
+typedef struct {
+	unsigned long long due;
+	tTraceRecord *record;
+} tPending;
+
+int debug = 0;
+int scale = 100;
+
+tTraceRecord *trace = NULL;
+int trace_count = 0;
+int trace_pos = 0;
+
+tPending *pending = NULL;
+int pending_count = 0;
+
+int commands = 0;
+int mismatches = 0;
+int extras = 0;
+int junk = 0;
+
+unsigned long long
+now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return((unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+unsigned int
+get_be32(uchar *p)
+{
+	return((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+int
+load_trace(char *name)
+{
+	uchar hdr[24];
+	FILE *fp;
+	int incl;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "trace %s could not be opened, error %d\n",
+			name, errno);
+		return(1);
+	}
+
+	if (fread(hdr, 16, 1, fp) != 1 || memcmp(hdr, "btsnoop", 8) ||
+		get_be32(&hdr[12]) != 1002) {
+		fprintf(stderr, "trace %s is not an H4 btsnoop file\n", name);
+		fclose(fp);
+		return(1);
+	}
+
+	while (fread(hdr, 24, 1, fp) == 1) {
+		incl = get_be32(&hdr[4]);
+
+		trace = realloc(trace, (trace_count + 1) * sizeof(tTraceRecord));
+		trace[trace_count].data = malloc(incl);
+
+		if (fread(trace[trace_count].data, incl, 1, fp) != 1) {
+			break;
+		}
+
+		trace[trace_count].ts = ((unsigned long long)get_be32(&hdr[16])
+			<< 32) | get_be32(&hdr[20]);
+		trace[trace_count].received = get_be32(&hdr[8]) & 1;
+		trace[trace_count].len = incl;
+		trace_count++;
+	}
+
+	fclose(fp);
+
+	pending = malloc((trace_count + 1) * sizeof(tPending));
+
+	return(0);
+}
+
+/*
+** Returns the opcode a Command Complete or Command Status answers, or -1
+** for any other record.
+*/
+int
+event_opcode(tTraceRecord *record)
+{
+	uchar *p = record->data;
+
+	if (!record->received || p[0] != 0x04) {
+		return(-1);
+	}
+
+	if (p[1] == 0x0e && record->len >= 6) {
+		return(p[4] | (p[5] << 8));
+	}
+
+	if (p[1] == 0x0f && record->len >= 7) {
+		return(p[5] | (p[6] << 8));
+	}
+
+	return(-1);
+}
+
+/*
+** Gives every event in the trace the command it belongs to.
+*/
+void
+assign_events()
+{
+	int oldest = 0;
+	int last = -1;
+	int opcode;
+	int i;
+	int j;
+
+	for (i = 0; i < trace_count; i++) {
+		trace[i].owner = -1;
+		trace[i].events = 0;
+		trace[i].answered = 0;
+		trace[i].matched = 0;
+
+		if (!trace[i].received) {
+			last = i;
+			continue;
+		}
+
+		j = last;
+
+		if ((opcode = event_opcode(&trace[i])) >= 0) {
+			while (oldest < i && (trace[oldest].received ||
+				trace[oldest].answered)) {
+				oldest++;
+			}
+
+			for (j = oldest; j < i; j++) {
+				if (!trace[j].received && !trace[j].answered &&
+					trace[j].len >= 3 &&
+					(trace[j].data[1] | (trace[j].data[2] << 8)) == opcode) {
+					trace[j].answered = 1;
+					break;
+				}
+			}
+
+			if (j == i) {
+				j = last;
+			}
+		}
+
+		if (j >= 0) {
+			trace[i].owner = j;
+			trace[j].events++;
+		}
+	}
+}
+
+/*
+** Queues the events that belong to trace command cmd, each delayed by its
+** recorded distance from that command.
+*/
+void
+queue_events(int cmd, unsigned long long now)
+{
+	unsigned long long due;
+	int left = trace[cmd].events;
+	int i;
+	int k;
+
+	for (i = cmd + 1; i < trace_count && left; i++) {
+		if (trace[i].owner != cmd) {
+			continue;
+		}
+
+		left--;
+
+		due = now + (trace[i].ts - trace[cmd].ts) * scale / 100;
+
+		for (k = pending_count; k > 0 && pending[k - 1].due > due; k--)
+			;
+
+		memmove(&pending[k + 1], &pending[k],
+			(pending_count - k) * sizeof(tPending));
+		pending[k].due = due;
+		pending[k].record = &trace[i];
+		pending_count++;
+	}
+}
+
+void
+proc_command(int fd, uchar *cmd, int len)
+{
+	uchar complete[] = { 0x04, 0x0e, 0x04, 0x01, 0x00, 0x00, 0x00 };
+	int seen = 0;
+	int i;
+
+	commands++;
+
+	while (trace_pos < trace_count && (trace[trace_pos].received ||
+		trace[trace_pos].matched)) {
+		trace_pos++;
+	}
+
+	if (trace_pos == trace_count) {
+		extras++;
+		complete[4] = cmd[1];
+		complete[5] = cmd[2];
+		write(fd, complete, sizeof(complete));
+		return;
+	}
+
+	for (i = trace_pos; i < trace_count && seen < REPLAY_WINDOW; i++) {
+		if (trace[i].received || trace[i].matched) {
+			continue;
+		}
+
+		if (trace[i].len >= 3 && memcmp(trace[i].data, cmd, 3) == 0) {
+			break;
+		}
+
+		seen++;
+	}
+
+	if (i == trace_count || seen == REPLAY_WINDOW) {
+		mismatches++;
+
+		if (debug) {
+			fprintf(stderr, "command %d is %02x%02x, trace has %02x%02x\n",
+				commands, cmd[2], cmd[1], trace[trace_pos].data[2],
+				trace[trace_pos].data[1]);
+		}
+
+		i = trace_pos;
+	}
+
+	trace[i].matched = 1;
+
+	queue_events(i, now_us());
+}
+
+void
+usage(char *argv0)
+{
+	printf("Usage %s:\n", argv0);
+	printf("\t<-d> to print a debug log\n");
+	printf("\t<--scale=percent>\n");
+	printf("\ttrace_file\n");
+	printf("\t<command [args]>, {} is replaced by the pseudo terminal\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"scale", 1, 0, 0},
+		{0, 0, 0, 0}
+	};
+	struct termios termios;
+	struct pollfd pfd;
+	unsigned long long start;
+	unsigned long long first = 0;
+	unsigned long long now;
+	uchar in[4096];
+	int in_len = 0;
+	int option_index;
+	int status = 0;
+	int timeout;
+	int count;
+	int fd;
+	int c;
+	int i;
+	pid_t pid = 0;
+	char *pty;
+
+	while ((c = getopt_long_only(argc, argv, "+d", long_options,
+		&option_index)) != -1) {
+		switch (c) {
+			case 0:
+				scale = atoi(optarg);
+				break;
+			case 'd':
+				debug = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (load_trace(argv[optind++])) {
+		exit(2);
+	}
+
+	assign_events();
+
+	if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) == -1 ||
+		grantpt(fd) || unlockpt(fd) || (pty = ptsname(fd)) == NULL) {
+		fprintf(stderr, "pseudo terminal could not be opened, error %d\n",
+			errno);
+		exit(3);
+	}
+
+	tcgetattr(fd, &termios);
+	cfmakeraw(&termios);
+	tcsetattr(fd, TCSANOW, &termios);
+
+	start = now_us();
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++) {
+			if (strcmp(argv[i], "{}") == 0) {
+				argv[i] = pty;
+			}
+		}
+
+		if ((pid = fork()) == 0) {
+			execvp(argv[optind], &argv[optind]);
+			fprintf(stderr, "%s could not be run, error %d\n",
+				argv[optind], errno);
+			exit(127);
+		}
+	} else {
+		printf("%s\n", pty);
+		fflush(stdout);
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		if (pid && waitpid(pid, &status, WNOHANG) == pid) {
+			break;
+		}
+
+		now = now_us();
+
+		while (pending_count && pending[0].due <= now) {
+			write(fd, pending[0].record->data, pending[0].record->len);
+			memmove(&pending[0], &pending[1],
+				--pending_count * sizeof(tPending));
+		}
+
+		timeout = 100;
+
+		if (pending_count && (pending[0].due - now) / 1000 < timeout) {
+			timeout = (pending[0].due - now) / 1000;
+		}
+
+		if (poll(&pfd, 1, timeout) <= 0) {
+			continue;
+		}
+
+		if (pfd.revents & POLLHUP) {
+			usleep(1000);
+			continue;
+		}
+
+		if ((count = read(fd, &in[in_len], sizeof(in) - in_len)) <= 0) {
+			continue;
+		}
+
+		if (!first) {
+			first = now_us();
+		}
+
+		in_len += count;
+
+		while (in_len) {
+			if (in[0] != 0x01) {
+				memmove(in, &in[1], --in_len);
+				junk++;
+				continue;
+			}
+
+			if (in_len < 4 || in_len < 4 + in[3]) {
+				break;
+			}
+
+			count = 4 + in[3];
+			proc_command(fd, in, count);
+			memmove(in, &in[count], in_len - count);
+			in_len -= count;
+		}
+	}
+
+	fprintf(stderr, "%llu ms, %d commands, %d not as traced, %d beyond "
+		"the trace, %d junk bytes\n", (now_us() - start) / 1000, commands,
+		mismatches, extras, junk);
+
+	if (first) {
+		fprintf(stderr, "first byte %llu us after start\n", first - start);
+	}
+
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+}
@@ -0,0 +1,253 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_script.c
+**
+**  Description:   Post patch configuration.  The built in commands
+**                 (bd_addr, sleep mode, SCO/PCM and I2S settings) and any
+**                 commands from a --script file are queued and sent to
+**                 the controller as one pipelined burst.
+**
+**                 A script file ending in .hcd is taken as a precompiled
+**                 list of records in the HCD format.  Any other file is a
+**                 text script, one command per line: a 16 bit opcode
+**                 followed by its parameter bytes, all in hex.  Everything
+**                 after a '#' is a comment.  For example
+**
+**                     # Write_BD_ADDR 43:29:b1:55:01:02
+**                     fc01 02 01 55 b1 29 43
+**
+**                 Every script command must complete with a success
+**                 status.  A built in command that fails is only warned
+**                 about, as the controller may not support it.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+static uchar *config_data = NULL;
+static int config_len = 0;
+static int config_size = 0;
+
+static int *config_records = NULL;
+static int config_count = 0;
+
+static char *script_name = NULL;
+
+void
+config_add(uchar *cmd, int len)
+{
+	while (config_len + len > config_size) {
+		config_size = config_size ? config_size * 2 : 256;
+		config_data = realloc(config_data, config_size);
+	}
+
+	config_records = realloc(config_records,
+		(config_count + 1) * sizeof(int));
+
+	if (config_data == NULL || config_records == NULL) {
+		fprintf(stderr, "no memory for configuration commands\n");
+		exit(7);
+	}
+
+	config_records[config_count++] = config_len;
+
+	memcpy(&config_data[config_len], cmd, len);
+	config_len += len;
+}
+
+static int
+parse_script_hcd(char *name)
+{
+	uchar cmd[1 + HCD_RECORD_HDR + 255];
+	int fd;
+	int len;
+
+	if ((fd = open(name, O_RDONLY)) == -1) {
+		fprintf(stderr, "script %s could not be opened, error %d\n",
+			name, errno);
+		return(1);
+	}
+
+	cmd[0] = 0x01;
+
+	while ((len = read(fd, &cmd[1], HCD_RECORD_HDR)) > 0) {
+		if (len != HCD_RECORD_HDR ||
+			read(fd, &cmd[4], cmd[3]) != cmd[3]) {
+			fprintf(stderr, "script %s truncated\n", name);
+			close(fd);
+			return(1);
+		}
+
+		config_add(cmd, 1 + HCD_RECORD_HDR + cmd[3]);
+	}
+
+	close(fd);
+
+	return(0);
+}
+
+static int
+parse_script_text(char *name)
+{
+	uchar cmd[1 + HCD_RECORD_HDR + 255];
+	char line[1024];
+	char *token;
+	char *end;
+	unsigned long value;
+	FILE *fp;
+	int lineno = 0;
+	int len;
+
+	if ((fp = fopen(name, "r")) == NULL) {
+		fprintf(stderr, "script %s could not be opened, error %d\n",
+			name, errno);
+		return(1);
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		if ((token = strchr(line, '#')) != NULL) {
+			*token = '\0';
+		}
+
+		len = 0;
+
+		for (token = strtok(line, " \t\r\n,"); token;
+			token = strtok(NULL, " \t\r\n,")) {
+			value = strtoul(token, &end, 16);
+
+			if (*end != '\0' || value > (len ? 0xff : 0xffff) ||
+				len == 1 + 255) {
+				fprintf(stderr, "script %s line %d: bad value %s\n",
+					name, lineno, token);
+				fclose(fp);
+				return(1);
+			}
+
+			if (len == 0) {
+				cmd[1] = value & 0xff;
+				cmd[2] = value >> 8;
+			} else {
+				cmd[3 + len] = value;
+			}
+
+			len++;
+		}
+
+		if (len == 0) {
+			continue;
+		}
+
+		cmd[0] = 0x01;
+		cmd[3] = len - 1;
+
+		config_add(cmd, 1 + HCD_RECORD_HDR + cmd[3]);
+	}
+
+	fclose(fp);
+
+	return(0);
+}
+
+static int
+load_script(char *name)
+{
+	char *p;
+
+	if ((p = strrchr(name, '.')) && strcasecmp("hcd", p + 1) == 0) {
+		return(parse_script_hcd(name));
+	}
+
+	return(parse_script_text(name));
+}
+
+/*
+** The script is only read when the configuration is sent, so that its
+** commands follow, and can override, the built in ones.
+*/
+int
+parse_script(char *optarg)
+{
+	if (access(optarg, R_OK) == -1) {
+		fprintf(stderr, "script %s could not be opened, error %d\n",
+			optarg, errno);
+		return(1);
+	}
+
+	script_name = optarg;
+
+	return(0);
+}
+
+void
+proc_config()
+{
+	unsigned int start = now_ms();
+	int builtin = config_count;
+	uchar *cmd;
+	int failed;
+
+	if (script_name && load_script(script_name)) {
+		exit(7);
+	}
+
+	if (config_count == 0) {
+		return;
+	}
+
+	phase_start(PHASE_CONFIG);
+
+	failed = send_commands(config_data, config_records, config_count, 255,
+		builtin);
+
+	stats.config_commands += config_count;
+	stats.config_ms += now_ms() - start;
+
+	if (failed >= 0) {
+		cmd = &config_data[config_records[failed]];
+
+		fprintf(stderr, "configuration command %02x%02x failed\n",
+			cmd[2], cmd[1]);
+		exit(7);
+	}
+}
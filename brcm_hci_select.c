@@ -0,0 +1,183 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_select.c
+**
+**  Description:   Firmware selection from an indexed firmware directory.
+**
+**                 With --firmware_dir=dir the HCD file is chosen after the
+**                 controller has been reset, from the chip id returned by
+**                 Read_Verbose_Config and the LMP subversion returned by
+**                 Read_Local_Version_Information.  They are looked up in
+**                 dir/brcm_firmware.idx, made by brcm_hcdtool index, which
+**                 has one line per file:
+**
+**                     chip_id lmp_subversion file digest
+**
+**                 chip_id and lmp_subversion are hex, a subversion of *
+**                 matches any, and an exact match wins.  file is relative
+**                 to dir.  digest is the 64 bit FNV-1a hash of the file,
+**                 checked when the file is loaded so that a stale index
+**                 cannot send the wrong firmware.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define FIRMWARE_INDEX		"brcm_firmware.idx"
+
+char *firmware_dir = NULL;
+unsigned long long firmware_digest = 0;
+
+uchar hci_read_local_version[] = { 0x01, 0x01, 0x10, 0x00 };
+
+int
+parse_firmware_dir(char *optarg)
+{
+	firmware_dir = optarg;
+	return(0);
+}
+
+unsigned long long
+hcd_digest(uchar *data, int len)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return(hash);
+}
+
+/*
+** Opens the HCD file listed for the controller in the firmware index and
+** returns 0, or returns 1 if the index has nothing for it.
+*/
+int
+firmware_select()
+{
+	char line[PATH_MAX + 64];
+	char file[PATH_MAX + 64];
+	char path[PATH_MAX];
+	char name[PATH_MAX];
+	char subver[16];
+	unsigned long long digest;
+	int lmp_subver;
+	int best = 0;
+	int match;
+	int id;
+	FILE *fp;
+
+	hci_send_cmd_or_exit(hci_read_local_version,
+		sizeof(hci_read_local_version));
+	read_event(buffer);
+
+	lmp_subver = buffer[13] | (buffer[14] << 8);
+
+	if (debug) {
+		fprintf(stderr, "chip %02x, lmp subversion %04x\n", chip_id,
+			lmp_subver);
+	}
+
+	if (snprintf(path, sizeof(path), "%s/%s", firmware_dir,
+		FIRMWARE_INDEX) >= sizeof(path)) {
+		fprintf(stderr, "firmware directory %s is too long\n", firmware_dir);
+		return(1);
+	}
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "firmware index %s could not be opened, error %d\n",
+			path, errno);
+		return(1);
+	}
+
+	/* file is as large as line, so no name can overflow it */
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%x %15s %s %llx", &id, subver, file,
+			&digest) != 4 || id != chip_id) {
+			continue;
+		}
+
+		if (strcmp(subver, "*") == 0) {
+			match = 1;
+		} else if (strtol(subver, NULL, 16) == lmp_subver) {
+			match = 2;
+		} else {
+			continue;
+		}
+
+		if (match <= best) {
+			continue;
+		}
+
+		if (snprintf(name, sizeof(name), "%s/%s", firmware_dir, file) >=
+			sizeof(name)) {
+			fprintf(stderr, "firmware path %s/%s is too long\n",
+				firmware_dir, file);
+			continue;
+		}
+
+		best = match;
+		firmware_digest = digest;
+		strcpy(path, name);
+	}
+
+	fclose(fp);
+
+	if (!best) {
+		return(1);
+	}
+
+	if (debug) {
+		fprintf(stderr, "firmware %s\n", path);
+	}
+
+	if ((hcdfile_fd = open(path, O_RDONLY)) == -1) {
+		fprintf(stderr, "file %s could not be opened, error %d\n", path,
+			errno);
+		exit(5);
+	}
+
+	return(0);
+}
@@ -0,0 +1,238 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_snoop.c
+**
+**  Description:   HCI trace capture in the btsnoop format (datalink type
+**                 1002, HCI UART H4), as read by Wireshark and the other
+**                 usual Bluetooth analysers.
+**
+**                 Packets are time stamped and copied into a lock free
+**                 ring of fixed size slots by whichever thread sends or
+**                 receives them.  A background thread drains the ring to
+**                 the file, so the I/O path never blocks on the disk.
+**                 When the ring is full packets are dropped and counted
+**                 in the btsnoop cumulative drops field.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define SNOOP_SLOTS		1024
+#define SNOOP_MAX_PACKET	264
+#define SNOOP_FLUSH_US		20000
+
+#define SNOOP_DATALINK_H4	1002
+
+/* microseconds from 0 AD to the Unix epoch */
+#define SNOOP_EPOCH_DELTA	0x00dcddb30f2f8000ULL
+
+typedef struct {
+	unsigned int seq;
+	unsigned int len;
+	unsigned int flags;
+	unsigned long long ts;
+	uchar data[SNOOP_MAX_PACKET];
+} tSnoopSlot;
+
+int btsnoop_fd = -1;
+
+static tSnoopSlot snoop_ring[SNOOP_SLOTS];
+static unsigned int snoop_head = 0;
+static unsigned int snoop_tail = 0;
+static unsigned int snoop_drops = 0;
+
+static pthread_t snoop_thread;
+static volatile int snoop_running = 0;
+
+static void
+put_be32(uchar *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+** Called from the I/O path.  Claims a slot with a compare and swap on
+** the head, fills it and publishes it through the slot's sequence number.
+*/
+void
+btsnoop_log(uchar *buf, int len, int received)
+{
+	struct timeval tv;
+	tSnoopSlot *slot;
+	unsigned int pos;
+	unsigned int seq;
+
+	gettimeofday(&tv, NULL);
+
+	pos = __atomic_load_n(&snoop_head, __ATOMIC_RELAXED);
+
+	while (1) {
+		slot = &snoop_ring[pos % SNOOP_SLOTS];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if ((int)(seq - pos) < 0) {
+			__atomic_add_fetch(&snoop_drops, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		if (seq == pos && __atomic_compare_exchange_n(&snoop_head, &pos,
+			pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+
+		if (seq != pos) {
+			pos = __atomic_load_n(&snoop_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->len = len;
+	slot->flags = received ? 0x03 : 0x02;
+	slot->ts = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec +
+		SNOOP_EPOCH_DELTA;
+	memcpy(slot->data, buf, len < SNOOP_MAX_PACKET ? len : SNOOP_MAX_PACKET);
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static void
+btsnoop_drain()
+{
+	uchar out[16 * (24 + SNOOP_MAX_PACKET)];
+	tSnoopSlot *slot;
+	int incl;
+	int n;
+
+	do {
+		n = 0;
+
+		while (n + 24 + SNOOP_MAX_PACKET <= sizeof(out)) {
+			slot = &snoop_ring[snoop_tail % SNOOP_SLOTS];
+
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+				snoop_tail + 1) {
+				break;
+			}
+
+			incl = slot->len < SNOOP_MAX_PACKET ?
+				slot->len : SNOOP_MAX_PACKET;
+
+			put_be32(&out[n], slot->len);
+			put_be32(&out[n + 4], incl);
+			put_be32(&out[n + 8], slot->flags);
+			put_be32(&out[n + 12],
+				__atomic_load_n(&snoop_drops, __ATOMIC_RELAXED));
+			put_be32(&out[n + 16], slot->ts >> 32);
+			put_be32(&out[n + 20], slot->ts);
+			memcpy(&out[n + 24], slot->data, incl);
+			n += 24 + incl;
+
+			__atomic_store_n(&slot->seq, snoop_tail + SNOOP_SLOTS,
+				__ATOMIC_RELEASE);
+			snoop_tail++;
+		}
+
+		if (n && write(btsnoop_fd, out, n) != n) {
+			fprintf(stderr, "btsnoop write failed, error %d\n", errno);
+		}
+	} while (n);
+}
+
+static void *
+btsnoop_writer(void *arg)
+{
+	while (snoop_running) {
+		usleep(SNOOP_FLUSH_US);
+		btsnoop_drain();
+	}
+
+	return(NULL);
+}
+
+static void
+btsnoop_close()
+{
+	if (snoop_running) {
+		snoop_running = 0;
+		pthread_join(snoop_thread, NULL);
+	}
+
+	btsnoop_drain();
+	close(btsnoop_fd);
+}
+
+int
+parse_btsnoop(char *optarg)
+{
+	uchar header[16] = { 'b', 't', 's', 'n', 'o', 'o', 'p', '\0' };
+	unsigned int i;
+
+	if ((btsnoop_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC,
+		0644)) == -1) {
+		fprintf(stderr, "btsnoop file %s could not be opened, error %d\n",
+			optarg, errno);
+		return(1);
+	}
+
+	put_be32(&header[8], 1);
+	put_be32(&header[12], SNOOP_DATALINK_H4);
+
+	write(btsnoop_fd, header, sizeof(header));
+
+	for (i = 0; i < SNOOP_SLOTS; i++) {
+		snoop_ring[i].seq = i;
+	}
+
+	snoop_running = 1;
+
+	if (pthread_create(&snoop_thread, NULL, btsnoop_writer, NULL) != 0) {
+		snoop_running = 0;
+	}
+
+	atexit(btsnoop_close);
+
+	return(0);
+}
@@ -0,0 +1,264 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_stream.c
+**
+**  Description:   Streaming download for controllers on RTS/CTS.
+**
+**                 With --stream the records are written back to back with
+**                 no window and no command credits, and the controller
+**                 holds the host off through CTS when it falls behind.
+**                 A receiver thread takes the completions as they come
+**                 and checks them against the records in order.  The
+**                 first bad status, or record_timeout ms without a
+**                 completion, stops the writer and fails the download
+**                 from that record, which proc_patchram() restarts as
+**                 for the windowed download.  Write_RAM completions do
+**                 not say which address they are for, so a lost one is
+**                 only noticed when the opcodes stop lining up or the
+**                 last one never comes.
+**
+**                 Launch_RAM is held back until every record before it
+**                 has completed, so a failure can still restart the
+**                 download before the patch runs.
+**
+**                 The report gives the most records the completions
+**                 were behind the writes, the longest time a record
+**                 waited for its completion and how long the last ones
+**                 took to arrive after the final write.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+int stream = 0;
+
+static uchar *stream_data;
+static int *stream_records;
+static int stream_count;
+
+/* written by the receiver, read by the writer */
+static int completed;
+static int failed;
+
+/* signalled by the receiver on each completion and when it stops */
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+
+/* when each record was written, for the completion lag */
+static unsigned long long *sent_us;
+
+static int max_behind = 0;
+static unsigned long long max_lag_us = 0;
+static unsigned long long tail_us = 0;
+
+int
+parse_stream(char *optarg)
+{
+	stream = 1;
+	return(0);
+}
+
+static void
+stream_progress()
+{
+	pthread_mutex_lock(&progress_lock);
+	pthread_cond_broadcast(&progress);
+	pthread_mutex_unlock(&progress_lock);
+}
+
+static void *
+stream_rx(void *arg)
+{
+	uchar buf[sizeof(buffer)];
+	unsigned long long lag;
+	int opcode;
+	int status;
+	int len;
+	uchar *cmd;
+
+	while (completed < stream_count) {
+		len = read_event_timeout(buf, record_timeout > 0 ?
+			record_timeout : HCI_RECORD_TIMEOUT_MS);
+
+		/* without a timeout, only to see whether the writer gave up */
+		if (len == 0 && record_timeout == 0 &&
+			__atomic_load_n(&failed, __ATOMIC_ACQUIRE) < 0) {
+			continue;
+		}
+
+		if (len == 0) {
+			stats.timeouts++;
+			break;
+		}
+
+		if (buf[0] != HCIT_TYPE_EVENT || len < 3) {
+			stats.bad_events++;
+			break;
+		}
+
+		if (buf[1] == HCI_EV_CMD_COMPLETE) {
+			opcode = buf[4] | (buf[5] << 8);
+			status = buf[6];
+		} else if (buf[1] == HCI_EV_CMD_STATUS) {
+			opcode = buf[5] | (buf[6] << 8);
+			status = buf[3];
+		} else {
+			continue;
+		}
+
+		cmd = &stream_data[stream_records[completed]];
+
+		if (opcode != (cmd[1] | (cmd[2] << 8)) || status != 0) {
+			stats.bad_events++;
+			break;
+		}
+
+		lag = now_us() -
+			__atomic_load_n(&sent_us[completed], __ATOMIC_ACQUIRE);
+
+		if (lag > max_lag_us) {
+			max_lag_us = lag;
+		}
+
+		__atomic_store_n(&completed, completed + 1, __ATOMIC_RELEASE);
+		stream_progress();
+	}
+
+	if (completed < stream_count &&
+		__atomic_load_n(&failed, __ATOMIC_ACQUIRE) < 0) {
+		__atomic_store_n(&failed, completed, __ATOMIC_RELEASE);
+	}
+
+	stream_progress();
+
+	return(NULL);
+}
+
+/*
+** Sends all count records without waiting for their completions.
+** Returns the index of the record that failed, or -1.
+*/
+int
+stream_commands(uchar *data, int *records, int count)
+{
+	pthread_t rx_thread;
+	unsigned long long last;
+	uchar *cmd;
+	int behind;
+	int sent;
+
+	stream_data = data;
+	stream_records = records;
+	stream_count = count;
+	completed = 0;
+	failed = -1;
+
+	if ((sent_us = calloc(count, sizeof(*sent_us))) == NULL) {
+		fprintf(stderr, "no memory for %d records\n", count);
+		exit(6);
+	}
+
+	if (pthread_create(&rx_thread, NULL, stream_rx, NULL) != 0) {
+		fprintf(stderr, "receiver thread could not be started, error %d\n",
+			errno);
+		exit(6);
+	}
+
+	for (sent = 0; sent < count; sent++) {
+		if (__atomic_load_n(&failed, __ATOMIC_ACQUIRE) >= 0) {
+			break;
+		}
+
+		cmd = &data[records[sent]];
+
+		if ((cmd[1] | (cmd[2] << 8)) == HCI_LAUNCH_RAM) {
+			pthread_mutex_lock(&progress_lock);
+
+			while (__atomic_load_n(&completed, __ATOMIC_ACQUIRE) < sent &&
+				__atomic_load_n(&failed, __ATOMIC_ACQUIRE) < 0) {
+				pthread_cond_wait(&progress, &progress_lock);
+			}
+
+			pthread_mutex_unlock(&progress_lock);
+
+			if (__atomic_load_n(&failed, __ATOMIC_ACQUIRE) >= 0) {
+				break;
+			}
+		}
+
+		__atomic_store_n(&sent_us[sent], now_us(), __ATOMIC_RELEASE);
+
+		if (hci_send_cmd(cmd, 1 + HCD_RECORD_HDR + cmd[3]) < 0) {
+			__atomic_store_n(&failed, sent, __ATOMIC_RELEASE);
+			break;
+		}
+
+		behind = sent + 1 - __atomic_load_n(&completed, __ATOMIC_ACQUIRE);
+
+		if (behind > max_behind) {
+			max_behind = behind;
+		}
+	}
+
+	last = now_us();
+
+	pthread_join(rx_thread, NULL);
+
+	if (failed < 0) {
+		tail_us = now_us() - last;
+	}
+
+	if (max_behind > stats.max_outstanding) {
+		stats.max_outstanding = max_behind;
+	}
+
+	free(sent_us);
+
+	return(failed);
+}
+
+void
+stream_report()
+{
+	fprintf(stderr, "stream: completions up to %d records and %llu us "
+		"behind, last one %llu us after the final write\n", max_behind,
+		max_lag_us, tail_us);
+}
@@ -0,0 +1,327 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_tune.c
+**
+**  Description:   Per device tuning of the download parameters.
+**
+**                 With --tune=state_file the window, the settle time after
+**                 the minidriver (tosleep) and the settle time after a
+**                 baud rate switch are learned for each device and chip,
+**                 as is whether the controller keeps the download baud
+**                 rate after Launch_RAM.
+**                 Every clean run tries a larger window and shorter
+**                 settle times, every run that needed retries backs off.
+**                 Settle times that caused errors are remembered and not
+**                 tried again.
+**
+**                 The state file has one line per device:
+**
+**                     device chip_id window tosleep tosleep_bad
+**                         baud_settle baud_settle_bad runs errors
+**                         launch_keeps_speed
+**
+**                 launch_keeps_speed is 1 if it does, -1 if it does not
+**                 and 0 if that is not known yet.  Lines without it, from
+**                 older versions, are read as 0.
+**
+**                 Before the controller is touched the entry is already
+**                 written back with backed off values, so a run that
+**                 dies half way leaves the next one with safer settings.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define TUNE_MAX_DEVICES	32
+#define TUNE_MAX_WINDOW		16
+#define TUNE_MIN_SETTLE		1000
+
+typedef struct {
+	char device[128];
+	int chip_id;
+	int window;
+	int tosleep;
+	int tosleep_bad;
+	int baud_settle;
+	int baud_settle_bad;
+	int runs;
+	int errors;
+	int launch_keeps_speed;
+} tTuneEntry;
+
+static char *tune_file = NULL;
+static tTuneEntry tune_entries[TUNE_MAX_DEVICES];
+static int tune_count = 0;
+static tTuneEntry *tune = NULL;
+static tTuneEntry initial;
+
+int
+parse_tune(char *optarg)
+{
+	tune_file = optarg;
+	return(0);
+}
+
+static void
+tune_write()
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", tune_file);
+
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "tune file %s could not be written, error %d\n",
+			tmp, errno);
+		return;
+	}
+
+	for (i = 0; i < tune_count; i++) {
+		fprintf(fp, "%s %02x %d %d %d %d %d %d %d %d\n",
+			tune_entries[i].device, tune_entries[i].chip_id,
+			tune_entries[i].window, tune_entries[i].tosleep,
+			tune_entries[i].tosleep_bad, tune_entries[i].baud_settle,
+			tune_entries[i].baud_settle_bad, tune_entries[i].runs,
+			tune_entries[i].errors, tune_entries[i].launch_keeps_speed);
+	}
+
+	if (fclose(fp) == 0) {
+		rename(tmp, tune_file);
+	}
+}
+
+static void
+tune_defaults(tTuneEntry *entry)
+{
+	entry->chip_id = -1;
+	entry->window = window;
+	entry->tosleep = tosleep;
+	entry->tosleep_bad = -1;
+	entry->baud_settle = baud_settle;
+	entry->baud_settle_bad = -1;
+	entry->runs = 0;
+	entry->errors = 0;
+	entry->launch_keeps_speed = launch_keeps_speed;
+}
+
+static int
+backoff_settle(int value)
+{
+	return(value < TUNE_MIN_SETTLE ? TUNE_MIN_SETTLE : value * 2);
+}
+
+/*
+** Picks up the learned settings for device, if any, and writes the entry
+** back with backed off values in case this run does not get as far as
+** tune_save().
+*/
+void
+tune_load(char *device)
+{
+	tTuneEntry saved;
+	tTuneEntry *entry;
+	char line[256];
+	int number = 0;
+	FILE *fp;
+	int i;
+
+	if (tune_file == NULL) {
+		return;
+	}
+
+	launch_learn = 1;
+
+	tune_defaults(&initial);
+
+	if ((fp = fopen(tune_file, "r")) != NULL) {
+		while (tune_count < TUNE_MAX_DEVICES &&
+			fgets(line, sizeof(line), fp) != NULL) {
+			number++;
+			entry = &tune_entries[tune_count];
+			entry->launch_keeps_speed = 0;
+
+			if (sscanf(line, "%127s %x %d %d %d %d %d %d %d %d",
+				entry->device, &entry->chip_id, &entry->window,
+				&entry->tosleep, &entry->tosleep_bad,
+				&entry->baud_settle, &entry->baud_settle_bad,
+				&entry->runs, &entry->errors,
+				&entry->launch_keeps_speed) < 9) {
+				/* the other devices' entries are still good */
+				if (debug) {
+					fprintf(stderr, "%s line %d not understood, skipped\n",
+						tune_file, number);
+				}
+
+				continue;
+			}
+
+			tune_count++;
+		}
+
+		fclose(fp);
+	}
+
+	for (i = 0; i < tune_count; i++) {
+		if (strcmp(tune_entries[i].device, device) == 0) {
+			tune = &tune_entries[i];
+			break;
+		}
+	}
+
+	if (tune == NULL) {
+		if (tune_count == TUNE_MAX_DEVICES) {
+			memmove(&tune_entries[0], &tune_entries[1],
+				(TUNE_MAX_DEVICES - 1) * sizeof(tTuneEntry));
+			tune_count--;
+		}
+
+		tune = &tune_entries[tune_count++];
+		*tune = initial;
+		strncpy(tune->device, device, sizeof(tune->device) - 1);
+		tune->device[sizeof(tune->device) - 1] = '\0';
+		return;
+	}
+
+	window = tune->window;
+	tosleep = tune->tosleep;
+	baud_settle = tune->baud_settle;
+
+	if (tune->launch_keeps_speed) {
+		launch_keeps_speed = tune->launch_keeps_speed;
+	}
+
+	if (debug) {
+		fprintf(stderr, "tuned window %d, tosleep %d, baud settle %d\n",
+			window, tosleep, baud_settle);
+	}
+
+	saved = *tune;
+
+	tune->window = tune->window > 1 ? tune->window / 2 : 1;
+	tune->tosleep = backoff_settle(tune->tosleep);
+	tune->baud_settle = backoff_settle(tune->baud_settle);
+
+	tune_write();
+
+	*tune = saved;
+}
+
+/*
+** Settings learned for a different chip on the same port do not apply.
+*/
+void
+tune_chip()
+{
+	if (tune == NULL || tune->chip_id == chip_id) {
+		return;
+	}
+
+	if (tune->chip_id != -1) {
+		if (debug) {
+			fprintf(stderr, "chip changed from %02x, tuning restarted\n",
+				tune->chip_id);
+		}
+
+		window = initial.window;
+		tosleep = initial.tosleep;
+		baud_settle = initial.baud_settle;
+		launch_keeps_speed = initial.launch_keeps_speed;
+
+		strcpy(initial.device, tune->device);
+		*tune = initial;
+	}
+
+	tune->chip_id = chip_id;
+}
+
+void
+tune_save()
+{
+	int errors;
+
+	if (tune == NULL) {
+		return;
+	}
+
+	errors = stats.timeouts + stats.bad_events + stats.restarts;
+
+	tune->runs++;
+	tune->errors += errors;
+	tune->launch_keeps_speed = launch_keeps_speed;
+
+	if (errors) {
+		tune->window = window > 1 ? window / 2 : 1;
+
+		if (tosleep > tune->tosleep_bad) {
+			tune->tosleep_bad = tosleep;
+		}
+
+		tune->tosleep = backoff_settle(tosleep);
+
+		if (baud_settle > tune->baud_settle_bad) {
+			tune->baud_settle_bad = baud_settle;
+		}
+
+		tune->baud_settle = backoff_settle(baud_settle);
+	} else {
+		tune->window = stats.max_outstanding < window ?
+			window : window + 1;
+
+		if (tune->window > TUNE_MAX_WINDOW) {
+			tune->window = TUNE_MAX_WINDOW;
+		}
+
+		tune->tosleep = tosleep / 2;
+
+		if (tune->tosleep <= tune->tosleep_bad) {
+			tune->tosleep = tosleep;
+		}
+
+		tune->baud_settle = baud_settle / 2;
+
+		if (tune->baud_settle <= tune->baud_settle_bad) {
+			tune->baud_settle = baud_settle;
+		}
+	}
+
+	tune_write();
+}
@@ -0,0 +1,537 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_uart.c
+**
+**  Description:   UART transport for the HCD download engine.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <glob.h>
+
+#ifdef ANDROID
+#include <termios.h>
+#else
+#include <sys/termios.h>
+#endif
+
+#include <sys/ioctl.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_uart.h"
+
+#define UART_PROBE_PORTS	32
+#define UART_PROBE_TIMEOUT_MS	500
+
+int uart_fd = -1;
+struct termios termios;
+char *uart_name = NULL;
+char *probe_pattern = NULL;
+
+static int uart_speed = B115200;
+
+/* the rate the controller was last told to use */
+int controller_speed = B115200;
+
+tBaudRates baud_rates[] = {
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+	{ 1000000, B1000000 },
+	{ 1152000, B1152000 },
+	{ 1500000, B1500000 },
+	{ 2000000, B2000000 },
+	{ 2500000, B2500000 },
+	{ 3000000, B3000000 },
+#ifndef __CYGWIN__
+	{ 3500000, B3500000 },
+	{ 4000000, B4000000 }
+#endif
+};
+
+int baud_rates_count = sizeof(baud_rates) / sizeof(tBaudRates);
+
+void
+BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
+{
+	if(baud_rate == 0 || encoded_baud == NULL) {
+		fprintf(stderr, "Baudrate not supported!");
+		return;
+	}
+
+	encoded_baud[3] = (uchar)(baud_rate >> 24);
+	encoded_baud[2] = (uchar)(baud_rate >> 16);
+	encoded_baud[1] = (uchar)(baud_rate >> 8);
+	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
+}
+
+int
+validate_baudrate(int baud_rate, int *value)
+{
+	int i;
+
+	for (i = 0; i < baud_rates_count; i++) {
+		if (baud_rates[i].baud_rate == baud_rate) {
+			*value = baud_rates[i].termios_value;
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+static void
+setup_uart(int fd, struct termios *t, int flow_control)
+{
+	tcflush(fd, TCIOFLUSH);
+	tcgetattr(fd, t);
+
+#ifndef __CYGWIN__
+	cfmakeraw(t);
+#else
+	t->c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
+                | INLCR | IGNCR | ICRNL | IXON);
+	t->c_oflag &= ~OPOST;
+	t->c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	t->c_cflag &= ~(CSIZE | PARENB);
+	t->c_cflag |= CS8;
+#endif
+
+	if (flow_control) {
+		t->c_cflag |= CRTSCTS;
+	} else {
+		t->c_cflag &= ~CRTSCTS;
+	}
+
+	tcsetattr(fd, TCSANOW, t);
+	tcflush(fd, TCIOFLUSH);
+	tcsetattr(fd, TCSANOW, t);
+	tcflush(fd, TCIOFLUSH);
+	tcflush(fd, TCIOFLUSH);
+	cfsetospeed(t, B115200);
+	cfsetispeed(t, B115200);
+	tcsetattr(fd, TCSANOW, t);
+}
+
+void
+init_uart(int flow_control)
+{
+	setup_uart(uart_fd, &termios, flow_control);
+
+	/* writes wait in uart_send() so that flow control can be timed */
+	fcntl(uart_fd, F_SETFL, fcntl(uart_fd, F_GETFL) | O_NONBLOCK);
+
+	uart_speed = B115200;
+}
+
+/*
+** Hands the port back in blocking mode once everything written has gone
+** out, for the line discipline or code that reads it directly.
+*/
+void
+uart_release()
+{
+	tcdrain(uart_fd);
+	fcntl(uart_fd, F_SETFL, fcntl(uart_fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+int
+parse_probe(char *optarg)
+{
+	probe_pattern = optarg;
+	return(0);
+}
+
+/*
+** Opens every port matching pattern, sends an HCI_Reset on all of them at
+** once and keeps the first one to answer with its Command Complete.  The
+** others get their original settings back and are closed.  Returns the
+** descriptor, with the name in uart_name, or -1.
+*/
+int
+uart_probe(char *pattern, int flow_control)
+{
+	uchar reply[UART_PROBE_PORTS][16];
+	int got[UART_PROBE_PORTS];
+	int path[UART_PROBE_PORTS];
+	struct termios saved[UART_PROBE_PORTS];
+	struct pollfd pfd[UART_PROBE_PORTS];
+	struct termios t;
+	unsigned int deadline;
+	unsigned int now;
+	glob_t g;
+	int found = -1;
+	int count = 0;
+	int n;
+	int i;
+
+	if (glob(pattern, 0, NULL, &g) != 0) {
+		fprintf(stderr, "no ports matched %s\n", pattern);
+		return(-1);
+	}
+
+	for (i = 0; i < g.gl_pathc && count < UART_PROBE_PORTS; i++) {
+		if ((pfd[count].fd = open(g.gl_pathv[i],
+			O_RDWR | O_NOCTTY | O_NONBLOCK)) == -1) {
+			continue;
+		}
+
+		if (tcgetattr(pfd[count].fd, &saved[count]) == -1) {
+			close(pfd[count].fd);
+			continue;
+		}
+
+		setup_uart(pfd[count].fd, &t, flow_control);
+		write(pfd[count].fd, hci_reset, sizeof(hci_reset));
+
+		pfd[count].events = POLLIN;
+		path[count] = i;
+		got[count] = 0;
+		count++;
+	}
+
+	/* names that matched but are no ports are not worth waiting for */
+	if (count == 0) {
+		globfree(&g);
+		fprintf(stderr, "no ports matched %s\n", pattern);
+		return(-1);
+	}
+
+	deadline = now_ms() + UART_PROBE_TIMEOUT_MS;
+
+	while (found < 0 && (now = now_ms()) < deadline) {
+		if (poll(pfd, count, deadline - now) <= 0) {
+			continue;
+		}
+
+		for (i = 0; i < count && found < 0; i++) {
+			if (!(pfd[i].revents & POLLIN)) {
+				continue;
+			}
+
+			if ((n = read(pfd[i].fd, &reply[i][got[i]],
+				sizeof(reply[i]) - got[i])) <= 0) {
+				continue;
+			}
+
+			got[i] += n;
+
+			/* skip anything before the start of an event */
+			while (got[i] && reply[i][0] != HCIT_TYPE_EVENT) {
+				memmove(reply[i], &reply[i][1], --got[i]);
+			}
+
+			if (got[i] >= 7 && reply[i][1] == HCI_EV_CMD_COMPLETE &&
+				reply[i][4] == hci_reset[1] &&
+				reply[i][5] == hci_reset[2]) {
+				found = i;
+			} else if (got[i] == sizeof(reply[i])) {
+				got[i] = 0;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (i == found) {
+			continue;
+		}
+
+		tcflush(pfd[i].fd, TCIOFLUSH);
+		tcsetattr(pfd[i].fd, TCSANOW, &saved[i]);
+		close(pfd[i].fd);
+	}
+
+	if (found < 0) {
+		globfree(&g);
+		fprintf(stderr, "no controller answered on %s\n", pattern);
+		return(-1);
+	}
+
+	uart_name = strdup(g.gl_pathv[path[found]]);
+	globfree(&g);
+
+	fcntl(pfd[found].fd, F_SETFL, 0);
+
+	if (debug) {
+		fprintf(stderr, "controller found on %s\n", uart_name);
+	}
+
+	return(pfd[found].fd);
+}
+
+/*
+** Waits for everything written to leave the line, so that a speed change
+** cannot cut off the end of the last command.  An empty TX queue can
+** still leave bytes in the UART's FIFO and shift register, so tcdrain()
+** is always called; the queue only goes into the report.
+*/
+static void
+uart_drain()
+{
+	unsigned long long start;
+	int queued = 0;
+
+	if (ioctl(uart_fd, TIOCOUTQ, &queued) == 0) {
+		stats.drain_bytes += queued;
+	}
+
+	start = now_us();
+	tcdrain(uart_fd);
+	stats.drain_us += now_us() - start;
+}
+
+void
+uart_set_speed(int termios_value)
+{
+	uart_drain();
+
+	cfsetospeed(&termios, termios_value);
+	cfsetispeed(&termios, termios_value);
+	tcsetattr(uart_fd, TCSANOW, &termios);
+
+	uart_speed = termios_value;
+}
+
+/*
+** Writes all of buf, waiting for room whenever CTS holds the TX queue
+** full.  Gives up after record_timeout ms without progress, unless it is
+** 0, and returns what was written.
+*/
+static int
+uart_send(uchar *buf, int len)
+{
+	unsigned long long start;
+	struct pollfd pfd;
+	int i = 0;
+	int count;
+
+	pfd.fd = uart_fd;
+	pfd.events = POLLOUT;
+
+	while (i < len) {
+		if ((count = write(uart_fd, &buf[i], len - i)) > 0) {
+			if ((i += count) < len) {
+				stats.tx_partial++;
+			}
+
+			continue;
+		}
+
+		if (count < 0 && errno != EAGAIN && errno != EINTR) {
+			return(-1);
+		}
+
+		start = now_us();
+		count = poll(&pfd, 1, record_timeout > 0 ? record_timeout : -1);
+		stats.tx_blocked_us += now_us() - start;
+
+		if (count == 0) {
+			if (debug) {
+				fprintf(stderr, "write held by flow control for %d ms\n",
+					record_timeout);
+			}
+
+			return(i);
+		}
+	}
+
+	return(i);
+}
+
+/*
+** Reads exactly len bytes unless timeout_ms passes without any data
+** arriving.  Returns the number of bytes read.
+*/
+static int
+uart_read_bytes(uchar *buf, int len, int timeout_ms)
+{
+	struct pollfd pfd;
+	int i = 0;
+	int count;
+
+	pfd.fd = uart_fd;
+	pfd.events = POLLIN;
+
+	while (i < len) {
+		count = poll(&pfd, 1, timeout_ms);
+
+		if (count < 0 && errno != EINTR) {
+			return(-1);
+		}
+
+		if (count <= 0) {
+			if (count == 0) {
+				return(i);
+			}
+
+			continue;
+		}
+
+		count = read(uart_fd, &buf[i], len - i);
+
+		if (count < 0 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+
+		if (count <= 0) {
+			return(-1);
+		}
+
+		i += count;
+	}
+
+	return(i);
+}
+
+/*
+** Reads the packet type, event code and length in one go.  Only when the
+** type is not an event, after line noise or stray bytes, is the header
+** moved on a byte at a time until it lines up with one.
+*/
+static int
+uart_read_event(uchar *buf, int size, int timeout_ms)
+{
+	int count;
+	int len;
+
+	if ((count = uart_read_bytes(buf, 3, timeout_ms)) < 3) {
+		return(count < 0 ? -1 : 0);
+	}
+
+	while (buf[0] != HCIT_TYPE_EVENT) {
+		buf[0] = buf[1];
+		buf[1] = buf[2];
+
+		if ((count = uart_read_bytes(&buf[2], 1, timeout_ms)) < 1) {
+			return(count < 0 ? -1 : 0);
+		}
+	}
+
+	len = buf[2];
+
+	if (3 + len > size) {
+		return(-1);
+	}
+
+	if ((count = uart_read_bytes(&buf[3], len, timeout_ms)) < len) {
+		return(count < 0 ? -1 : 0);
+	}
+
+	return(3 + len);
+}
+
+static void
+uart_default_speed()
+{
+	if (uart_speed != B115200) {
+		uart_set_speed(B115200);
+	}
+
+	controller_speed = B115200;
+}
+
+/*
+** Returns 1 if both ends already run at termios_value, so that the
+** Update_UART_Baud_Rate round trip can be skipped.
+*/
+int
+uart_at_speed(int termios_value)
+{
+	return(uart_speed == termios_value && controller_speed == termios_value);
+}
+
+/*
+** After an Update_UART_Baud_Rate that got no answer in time the
+** controller may or may not have switched.  HCI_Reset is tried at
+** termios_value and then at 115200.  Returns 1 if the controller is at
+** termios_value, 0 if it is at 115200, and exits with 9 if it answers at
+** neither.
+*/
+int
+uart_find_speed(int termios_value)
+{
+	uart_set_speed(termios_value);
+	hci_send_cmd(hci_reset, sizeof(hci_reset));
+	stats.resets++;
+
+	if (wait_reset(HCI_LAUNCH_TIMEOUT_MS)) {
+		controller_speed = termios_value;
+		return(1);
+	}
+
+	tcflush(uart_fd, TCIFLUSH);
+	uart_set_speed(B115200);
+	hci_send_cmd(hci_reset, sizeof(hci_reset));
+	stats.resets++;
+
+	if (wait_reset(HCI_LAUNCH_TIMEOUT_MS)) {
+		controller_speed = B115200;
+		return(0);
+	}
+
+	fprintf(stderr, "controller lost after the baud rate switch\n");
+
+	engine_report();
+
+	exit(9);
+}
+
+/*
+** Lets what is still queued go out first, so that the answers to it can
+** only arrive after the discarded input if at all.
+*/
+static void
+uart_flush()
+{
+	uart_drain();
+	tcflush(uart_fd, TCIFLUSH);
+}
+
+tHciTransport uart_transport = {
+	"uart",
+	uart_send,
+	uart_read_event,
+	uart_read_bytes,
+	uart_default_speed,
+	uart_flush,
+	&uart_fd
+};
@@ -0,0 +1,68 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_uart.h
+**
+**  Description:   UART transport for the HCD download engine.  Used by
+**                 brcm_patchram_plus (H4, RTS/CTS flow control) and
+**                 brcm_patchram_plus_h5 (no flow control).
+**
+******************************************************************************/
+
+#ifndef BRCM_HCI_UART_H
+#define BRCM_HCI_UART_H
+
+#ifdef ANDROID
+#include <termios.h>
+#else
+#include <sys/termios.h>
+#endif
+
+#include "brcm_hci_engine.h"
+
+typedef struct {
+	int baud_rate;
+	int termios_value;
+} tBaudRates;
+
+extern tHciTransport uart_transport;
+
+extern int uart_fd;
+extern struct termios termios;
+extern char *uart_name;
+extern char *probe_pattern;
+extern int controller_speed;
+
+extern tBaudRates baud_rates[];
+extern int baud_rates_count;
+
+void BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud);
+int validate_baudrate(int baud_rate, int *value);
+
+void init_uart(int flow_control);
+void uart_release();
+void uart_set_speed(int termios_value);
+int uart_at_speed(int termios_value);
+int uart_find_speed(int termios_value);
+
+int parse_probe(char *optarg);
+int uart_probe(char *pattern, int flow_control);
+
+#endif
@@ -0,0 +1,595 @@
+/*******************************************************************************
+ *
+ *  Copyright (C) 2009-2011 Broadcom Corporation
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+/*****************************************************************************
+**
+**  Name:          brcm_hci_uring.c
+**
+**  Description:   io_uring transport for the UART and the HCI socket.
+**
+**                 With --io_uring, commands are not written when they are
+**                 sent but queued, and go to the kernel together with the
+**                 next read in a single io_uring_enter().  Queued commands
+**                 are linked so they reach the line in order.  A read
+**                 fills a buffer that can hold several events, which are
+**                 then handed out without another system call, and a
+**                 linked timeout bounds each read.
+**
+**                 The ring is driven with the raw system calls, so only
+**                 the kernel headers are needed.  If the kernel has no
+**                 io_uring the plain transport is used.
+**
+******************************************************************************/
+
+#include <stdio.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#ifdef ANDROID
+#define LOG_TAG "brcm_patchram_plus"
+#include <cutils/log.h>
+#undef printf
+#define printf LOGD
+#undef fprintf
+#define fprintf(x, ...) \
+  { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
+#endif //ANDROID
+
+#include "brcm_hci_engine.h"
+
+#define URING_ENTRIES		64
+#define URING_WRITES		32
+#define URING_MAX_PACKET	260
+#define URING_RX_SIZE		4096
+
+#define URING_TAG_READ		0x10000
+#define URING_TAG_TIMEOUT	0x20000
+
+typedef struct {
+	int len;
+	int off;
+	int done;
+	uchar data[URING_MAX_PACKET];
+} tUringWrite;
+
+int io_uring = 0;
+
+static tHciTransport *inner;
+static int ring_fd = -1;
+static int io_fd = -1;
+static int io_flags = 0;
+
+static unsigned int *sq_head;
+static unsigned int *sq_tail;
+static unsigned int *sq_mask;
+static unsigned int *sq_array;
+static struct io_uring_sqe *sqes;
+static unsigned int *cq_head;
+static unsigned int *cq_tail;
+static unsigned int *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned int to_submit = 0;
+
+/* the mappings, MAP_FAILED when not mapped and cq_ring == sq_ring if one */
+static unsigned char *sq_ring = MAP_FAILED;
+static unsigned char *cq_ring = MAP_FAILED;
+static size_t sq_ring_size;
+static size_t cq_ring_size;
+static size_t sqes_size;
+
+/* commands in the order they were sent, the first chained ones in flight */
+static tUringWrite writes[URING_WRITES];
+static unsigned int write_head = 0;
+static unsigned int write_tail = 0;
+static int chained = 0;
+static int write_error = 0;
+
+static uchar rx[URING_RX_SIZE];
+static int rx_len = 0;
+static int read_done;
+static int read_res;
+
+static struct __kernel_timespec read_timeout;
+
+static unsigned int enters = 0;
+static unsigned int sqes_submitted = 0;
+
+int
+parse_io_uring(char *optarg)
+{
+	io_uring = 1;
+	return(0);
+}
+
+static int
+uring_enter(unsigned int min_complete)
+{
+	int count;
+
+	enters++;
+
+	count = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+		min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+	if (count < 0) {
+		return(errno == EINTR || errno == EAGAIN || errno == EBUSY ?
+			0 : -1);
+	}
+
+	sqes_submitted += count;
+	to_submit -= count;
+
+	return(0);
+}
+
+static struct io_uring_sqe *
+uring_get_sqe()
+{
+	unsigned int tail = *sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == URING_ENTRIES) {
+		uring_enter(0);
+	}
+
+	sqe = &sqes[tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[tail & *sq_mask] = tail & *sq_mask;
+
+	return(sqe);
+}
+
+static void
+uring_queue_sqe()
+{
+	__atomic_store_n(sq_tail, *sq_tail + 1, __ATOMIC_RELEASE);
+	to_submit++;
+}
+
+/*
+** Puts every command not yet on the line into one linked chain, unless
+** the previous chain is still in flight.
+*/
+static void
+uring_submit_writes()
+{
+	struct io_uring_sqe *sqe;
+	tUringWrite *w;
+	unsigned int i;
+
+	if (chained) {
+		return;
+	}
+
+	while (write_head != write_tail && writes[write_head % URING_WRITES].done) {
+		write_head++;
+	}
+
+	for (i = write_head; i != write_tail; i++) {
+		w = &writes[i % URING_WRITES];
+
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = io_fd;
+		sqe->addr = (unsigned long)&w->data[w->off];
+		sqe->len = w->len - w->off;
+		sqe->user_data = i % URING_WRITES;
+
+		if (i + 1 != write_tail) {
+			sqe->flags = IOSQE_IO_LINK;
+		}
+
+		uring_queue_sqe();
+		chained++;
+	}
+}
+
+static void
+uring_reap()
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head = *cq_head;
+	tUringWrite *w;
+
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &cqes[head & *cq_mask];
+
+		if (cqe->user_data == URING_TAG_READ) {
+			read_done = 1;
+			read_res = cqe->res;
+		} else if (cqe->user_data < URING_WRITES) {
+			w = &writes[cqe->user_data];
+			chained--;
+
+			if (cqe->res > 0) {
+				w->off += cqe->res;
+				w->done = w->off == w->len;
+			} else if (cqe->res != -ECANCELED && cqe->res != -EINTR &&
+				cqe->res != -EAGAIN) {
+				errno = -cqe->res;
+				write_error = 1;
+			}
+		}
+
+		head++;
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/*
+** Reads whatever arrives into rx, waiting at most timeout_ms.  Returns
+** the number of bytes read, 0 on timeout and -1 on error.  While rx is
+** full no read is posted, as the bytes in it have not been taken yet, and
+** their number is returned instead.
+*/
+static int
+uring_read(int timeout_ms)
+{
+	struct io_uring_sqe *sqe;
+
+	uring_submit_writes();
+
+	if (rx_len == sizeof(rx)) {
+		return(rx_len);
+	}
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = io_fd;
+	sqe->addr = (unsigned long)&rx[rx_len];
+	sqe->len = sizeof(rx) - rx_len;
+	sqe->user_data = URING_TAG_READ;
+
+	if (timeout_ms >= 0) {
+		sqe->flags = IOSQE_IO_LINK;
+		uring_queue_sqe();
+
+		read_timeout.tv_sec = timeout_ms / 1000;
+		read_timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+		sqe = uring_get_sqe();
+		sqe->opcode = IORING_OP_LINK_TIMEOUT;
+		sqe->addr = (unsigned long)&read_timeout;
+		sqe->len = 1;
+		sqe->user_data = URING_TAG_TIMEOUT;
+	}
+
+	uring_queue_sqe();
+
+	read_done = 0;
+
+	while (!read_done) {
+		if (uring_enter(1) < 0) {
+			return(-1);
+		}
+
+		uring_reap();
+
+		if (write_error) {
+			return(-1);
+		}
+
+		uring_submit_writes();
+	}
+
+	if (read_res == -ECANCELED || read_res == -EINTR ||
+		read_res == -EAGAIN) {
+		return(0);
+	}
+
+	if (read_res <= 0) {
+		errno = -read_res;
+		return(-1);
+	}
+
+	rx_len += read_res;
+
+	return(read_res);
+}
+
+static void
+rx_consume(int len)
+{
+	memmove(rx, &rx[len], rx_len - len);
+	rx_len -= len;
+}
+
+static int
+uring_send(uchar *buf, int len)
+{
+	tUringWrite *w;
+
+	if (len > URING_MAX_PACKET) {
+		return(-1);
+	}
+
+	while (write_tail - write_head == URING_WRITES) {
+		if (uring_enter(1) < 0) {
+			return(-1);
+		}
+
+		uring_reap();
+		uring_submit_writes();
+	}
+
+	w = &writes[write_tail % URING_WRITES];
+	w->len = len;
+	w->off = 0;
+	w->done = 0;
+	memcpy(w->data, buf, len);
+	write_tail++;
+
+	return(len);
+}
+
+static int
+uring_read_event(uchar *buf, int size, int timeout_ms)
+{
+	unsigned int deadline = now_ms() + timeout_ms;
+	int remaining = timeout_ms;
+	int skip;
+	int len;
+	int count;
+
+	while (1) {
+		for (skip = 0; skip < rx_len && rx[skip] != HCIT_TYPE_EVENT; skip++)
+			;
+		rx_consume(skip);
+
+		if (rx_len >= 3 && rx_len >= 3 + rx[2]) {
+			len = 3 + rx[2];
+
+			if (len > size) {
+				return(-1);
+			}
+
+			memcpy(buf, rx, len);
+			rx_consume(len);
+
+			return(len);
+		}
+
+		if (timeout_ms >= 0) {
+			remaining = deadline - now_ms();
+
+			if (remaining < 0 || remaining > timeout_ms) {
+				return(0);
+			}
+
+			if (remaining == 0) {
+				remaining = 1;
+			}
+		}
+
+		if ((count = uring_read(remaining)) <= 0) {
+			return(count);
+		}
+	}
+}
+
+static int
+uring_read_bytes(uchar *buf, int len, int timeout_ms)
+{
+	unsigned int deadline = now_ms() + timeout_ms;
+	int remaining = timeout_ms;
+	int count;
+
+	while (rx_len < len) {
+		if (timeout_ms >= 0) {
+			remaining = deadline - now_ms();
+
+			if (remaining <= 0 || remaining > timeout_ms) {
+				break;
+			}
+		}
+
+		if ((count = uring_read(remaining)) < 0) {
+			return(-1);
+		}
+	}
+
+	count = rx_len < len ? rx_len : len;
+	memcpy(buf, rx, count);
+	rx_consume(count);
+
+	return(count);
+}
+
+/*
+** Waits until every queued command has been handed to the descriptor.
+*/
+static void
+uring_push()
+{
+	uring_submit_writes();
+
+	while (chained || to_submit) {
+		if (uring_enter(chained ? 1 : 0) < 0) {
+			break;
+		}
+
+		uring_reap();
+		uring_submit_writes();
+	}
+}
+
+static void
+uring_flush()
+{
+	uring_push();
+
+	rx_len = 0;
+
+	if (inner->flush) {
+		inner->flush();
+	}
+}
+
+static void
+uring_unmap()
+{
+	if (sqes != MAP_FAILED && sqes != NULL) {
+		munmap(sqes, sqes_size);
+	}
+
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+		munmap(cq_ring, cq_ring_size);
+	}
+
+	if (sq_ring != MAP_FAILED) {
+		munmap(sq_ring, sq_ring_size);
+	}
+
+	sqes = NULL;
+	sq_ring = cq_ring = MAP_FAILED;
+
+	close(ring_fd);
+	ring_fd = -1;
+}
+
+static tHciTransport uring_transport = {
+	"io_uring", uring_send, uring_read_event, uring_read_bytes, NULL,
+	uring_flush, NULL
+};
+
+void
+uring_start(int fd)
+{
+	struct io_uring_params p;
+
+	if (!io_uring) {
+		return;
+	}
+
+	if (duplex) {
+		fprintf(stderr, "--duplex is not used with --io_uring\n");
+		duplex = 0;
+	}
+
+	if (stream) {
+		fprintf(stderr, "--stream is not used with --io_uring\n");
+		stream = 0;
+	}
+
+	memset(&p, 0, sizeof(p));
+
+	if ((ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0) {
+		fprintf(stderr, "io_uring not available, error %d\n", errno);
+		return;
+	}
+
+	sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_ring_size > sq_ring_size) {
+			sq_ring_size = cq_ring_size;
+		}
+
+		cq_ring_size = sq_ring_size;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+	cq_ring = sq_ring;
+
+	if (sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	}
+
+	sqes = MAP_FAILED;
+
+	if (cq_ring != MAP_FAILED) {
+		sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	}
+
+	if (sqes == MAP_FAILED) {
+		fprintf(stderr, "io_uring could not be mapped, error %d\n", errno);
+		uring_unmap();
+		return;
+	}
+
+	sq_head = (unsigned int *)(sq_ring + p.sq_off.head);
+	sq_tail = (unsigned int *)(sq_ring + p.sq_off.tail);
+	sq_mask = (unsigned int *)(sq_ring + p.sq_off.ring_mask);
+	sq_array = (unsigned int *)(sq_ring + p.sq_off.array);
+	cq_head = (unsigned int *)(cq_ring + p.cq_off.head);
+	cq_tail = (unsigned int *)(cq_ring + p.cq_off.tail);
+	cq_mask = (unsigned int *)(cq_ring + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq_ring + p.cq_off.cqes);
+
+	io_fd = fd;
+	inner = transport;
+
+	/* io_uring does its own waiting, O_NONBLOCK would only fail reads */
+	io_flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, io_flags & ~O_NONBLOCK);
+
+	uring_transport.name = inner->name;
+	uring_transport.default_speed = inner->default_speed;
+
+	transport = &uring_transport;
+}
+
+/*
+** Waits for the queued commands to reach the line, takes the ring down
+** and hands the plain transport back, for the code that reads and writes
+** the descriptor directly.
+*/
+void
+uring_stop()
+{
+	if (transport != &uring_transport) {
+		return;
+	}
+
+	uring_push();
+	uring_unmap();
+
+	fcntl(io_fd, F_SETFL, io_flags);
+
+	transport = inner;
+}
+
+void
+uring_report()
+{
+	if (enters == 0) {
+		return;
+	}
+
+	fprintf(stderr, "io_uring: %u submissions in %u system calls\n",
+		sqes_submitted, enters);
+}
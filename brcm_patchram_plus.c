@@ -26,12 +26,14 @@
 **
 **                 It can be invoked from the command line in the form
 **						<-d> to print a debug log
-**						<--patchram patchram_file>
+**						<--patchram patchram_file[,patchram_file...]>
 **						<--baudrate baud_rate>
 **						<--bd_addr bd_address>
 **						<--enable_lpm>
 **						<--enable_hci>
 **						<--use_baudrate_for_download>
+**						<--launch_keeps_baudrate to try the reset after
+**							Launch_RAM at the download baud rate first>
 **						<--scopcm=sco_routing,pcm_interface_rate,frame_type,
 **							sync_mode,clock_mode,lsb_first,fill_bits,
 **							fill_method,fill_num,right_justify>
@@ -81,6 +83,45 @@
 **                          do not generate these two bytes.>
 **						<--tosleep=number of microsseconds to sleep before
 **							patchram download begins.>
+**						<--window=number of patchram records to keep
+**							outstanding, limited by the controller's
+**							command credits.  Default is 1.>
+**						<--script=file of vendor commands to send after
+**							the download>
+**						<--record_timeout=milliseconds to wait for each
+**							command to complete before retrying it, 0 to
+**							wait forever.  Default is 1000.>
+**						<--record_retries=number of times a command is
+**							retried before the download is restarted from
+**							the minidriver.  Default is 3.>
+**						<--tune=state file in which the window and settle
+**							times learned for this device are kept>
+**						<--btsnoop=file to record all HCI traffic to, in
+**							the btsnoop format>
+**						<--log_rate=maximum number of packets logged per
+**							second with -d, 0 for all.  Default is 100.>
+**						<--log_level=0 for errors only, 1 for progress
+**							messages, 2 for HCI packets as well (-d)>
+**						<--duplex to write records and read events on
+**							separate threads>
+**						<--io_uring to batch reads and writes through
+**							io_uring>
+**						<--realtime=SCHED_FIFO priority of the I/O thread,
+**							optionally followed by ,cpu to pin it to>
+**						<--firmware_dir=directory with a brcm_firmware.idx
+**							to pick the patchram file from>
+**						<--probe=pattern of the ports to look for the
+**							controller on, instead of uart_device_name>
+**						<--deadline=milliseconds the whole run may take>
+**						<--ready_fd=descriptor to write READY=1 to once
+**							the line discipline is attached>
+**						<--detach to go into the background at that point>
+**						<--pass_fd=Unix socket of the HCI stack to send the
+**							configured port to, instead of attaching it>
+**						<--fdstore to leave the configured port in the
+**							service manager's descriptor store instead>
+**						<--stream to send the patchram back to back and
+**							leave the pacing to RTS/CTS>
 **						uart_device_name
 **
 **                 For example:
@@ -122,6 +163,7 @@
 
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 
 #ifdef ANDROID
 #include <cutils/properties.h>
@@ -135,6 +177,8 @@
 
 #endif //ANDROID
 
+#include "brcm_hci_uart.h"
+
 #ifndef N_HCI
 #define N_HCI	15
 #endif
@@ -149,29 +193,15 @@
 #define HCI_UART_H4DS	3
 #define HCI_UART_LL		4
 
-typedef unsigned char uchar;
-
-int uart_fd = -1;
-int hcdfile_fd = -1;
 int termios_baudrate = 0;
 int bdaddr_flag = 0;
 int enable_lpm = 0;
 int enable_hci = 0;
 int use_baudrate_for_download = 0;
-int debug = 0;
 int scopcm = 0;
 int i2s = 0;
-int no2bytes = 0;
-int tosleep = 0;
 int baudrate = 0;
 
-struct termios termios;
-uchar buffer[1024];
-
-uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
-
-uchar hci_download_minidriver[] = { 0x01, 0x2e, 0xfc, 0x00 };
-
 uchar hci_update_baud_rate[] = { 0x01, 0x18, 0xfc, 0x06, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00 };
 
@@ -194,84 +224,6 @@ uchar hci_write_i2spcm_interface_param[] =
 uchar hci_write_uart_clock_setting_48Mhz[] =
 	{ 0x01, 0x45, 0xfc, 0x01, 0x01 };
 
-int
-parse_patchram(char *optarg)
-{
-	char *p;
-
-	if (!(p = strrchr(optarg, '.'))) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(3);
-	}
-
-	p++;
-
-	if (strcasecmp("hcd", p) != 0) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(4);
-	}
-
-	if ((hcdfile_fd = open(optarg, O_RDONLY)) == -1) {
-		fprintf(stderr, "file %s could not be opened, error %d\n", optarg, errno);
-		exit(5);
-	}
-
-	return(0);
-}
-
-void
-BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
-{
-	if(baud_rate == 0 || encoded_baud == NULL) {
-		fprintf(stderr, "Baudrate not supported!");
-		return;
-	}
-
-	encoded_baud[3] = (uchar)(baud_rate >> 24);
-	encoded_baud[2] = (uchar)(baud_rate >> 16);
-	encoded_baud[1] = (uchar)(baud_rate >> 8);
-	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
-}
-
-typedef struct {
-	int baud_rate;
-	int termios_value;
-} tBaudRates;
-
-tBaudRates baud_rates[] = {
-	{ 115200, B115200 },
-	{ 230400, B230400 },
-	{ 460800, B460800 },
-	{ 500000, B500000 },
-	{ 576000, B576000 },
-	{ 921600, B921600 },
-	{ 1000000, B1000000 },
-	{ 1152000, B1152000 },
-	{ 1500000, B1500000 },
-	{ 2000000, B2000000 },
-	{ 2500000, B2500000 },
-	{ 3000000, B3000000 },
-#ifndef __CYGWIN__
-	{ 3500000, B3500000 },
-	{ 4000000, B4000000 }
-#endif
-};
-
-int
-validate_baudrate(int baud_rate, int *value)
-{
-	unsigned int i;
-
-	for (i = 0; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
-		if (baud_rates[i].baud_rate == baud_rate) {
-			*value = baud_rates[i].termios_value;
-			return(1);
-		}
-	}
-
-	return(0);
-}
-
 int
 parse_baudrate(char *optarg)
 {
@@ -399,15 +351,20 @@ parse_tosleep(char *optarg)
 void
 usage(char *argv0)
 {
+#ifdef BRCM_TINY
+	printf("Usage %s: [options] uart_device_name, see "
+		"brcm_patchram_plus(1)\n", argv0);
+#else
 	printf("Usage %s:\n", argv0);
 	printf("\t<-d> to print a debug log\n");
-	printf("\t<--patchram patchram_file>\n");
+	printf("\t<--patchram patchram_file[,patchram_file...]>\n");
 	printf("\t<--baudrate baud_rate>\n");
 	printf("\t<--bd_addr bd_address>\n");
 	printf("\t<--enable_lpm>\n");
 	printf("\t<--enable_hci>\n");
 	printf("\t<--use_baudrate_for_download> - Uses the\n");
 	printf("\t\tbaudrate for downloading the firmware\n");
+	printf("\t<--launch_keeps_baudrate>\n");
 	printf("\t<--scopcm=sco_routing,pcm_interface_rate,frame_type,\n");
 	printf("\t\tsync_mode,clock_mode,lsb_first,fill_bits,\n");
 	printf("\t\tfill_method,fill_num,right_justify>\n");
@@ -438,7 +395,27 @@ usage(char *argv0)
 	printf("\t\tbefore starting patchram download. Newer chips\n");
 	printf("\t\tdo not generate these two bytes.>\n");
 	printf("\t<--tosleep=microseconds>\n");
+	printf("\t<--window=records>\n");
+	printf("\t<--script=config_script>\n");
+	printf("\t<--record_timeout=milliseconds>\n");
+	printf("\t<--record_retries=retries>\n");
+	printf("\t<--tune=state_file>\n");
+	printf("\t<--btsnoop=trace_file>\n");
+	printf("\t<--log_rate=packets_per_second>\n");
+	printf("\t<--log_level=level>\n");
+	printf("\t<--duplex>\n");
+	printf("\t<--io_uring>\n");
+	printf("\t<--realtime=priority[,cpu]>\n");
+	printf("\t<--firmware_dir=directory>\n");
+	printf("\t<--probe=pattern>\n");
+	printf("\t<--deadline=milliseconds>\n");
+	printf("\t<--ready_fd=descriptor>\n");
+	printf("\t<--detach>\n");
+	printf("\t<--pass_fd=socket_path>\n");
+	printf("\t<--fdstore>\n");
+	printf("\t<--stream>\n");
 	printf("\tuart_device_name\n");
+#endif
 }
 
 int
@@ -451,8 +428,17 @@ parse_cmd_line(int argc, char **argv)
 
 	PFI parse[] = { parse_patchram, parse_baudrate,
 		parse_bdaddr, parse_enable_lpm, parse_enable_hci,
-		parse_use_baudrate_for_download,
-		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep};
+		parse_use_baudrate_for_download, parse_launch_keeps_baudrate,
+		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep,
+		parse_window, parse_script, parse_record_timeout,
+		parse_record_retries, parse_log_rate, parse_log_level,
+		parse_firmware_dir, parse_probe, parse_deadline,
+#ifndef BRCM_TINY
+		parse_tune, parse_btsnoop, parse_duplex, parse_io_uring,
+		parse_realtime, parse_stream, parse_ready_fd, parse_detach,
+		parse_pass_fd, parse_fdstore,
+#endif
+		};
 
 	while (1) {
 		int this_option_optind = optind ? optind : 1;
@@ -465,10 +451,32 @@ parse_cmd_line(int argc, char **argv)
 			{"enable_lpm", 0, 0, 0},
 			{"enable_hci", 0, 0, 0},
 			{"use_baudrate_for_download", 0, 0, 0},
+			{"launch_keeps_baudrate", 0, 0, 0},
 			{"scopcm", 1, 0, 0},
 			{"i2s", 1, 0, 0},
 			{"no2bytes", 0, 0, 0},
 			{"tosleep", 1, 0, 0},
+			{"window", 1, 0, 0},
+			{"script", 1, 0, 0},
+			{"record_timeout", 1, 0, 0},
+			{"record_retries", 1, 0, 0},
+			{"log_rate", 1, 0, 0},
+			{"log_level", 1, 0, 0},
+			{"firmware_dir", 1, 0, 0},
+			{"probe", 1, 0, 0},
+			{"deadline", 1, 0, 0},
+#ifndef BRCM_TINY
+			{"tune", 1, 0, 0},
+			{"btsnoop", 1, 0, 0},
+			{"duplex", 0, 0, 0},
+			{"io_uring", 0, 0, 0},
+			{"realtime", 1, 0, 0},
+			{"stream", 0, 0, 0},
+			{"ready_fd", 1, 0, 0},
+			{"detach", 0, 0, 0},
+			{"pass_fd", 1, 0, 0},
+			{"fdstore", 0, 0, 0},
+#endif
 			{0, 0, 0, 0}
 		};
 
@@ -493,7 +501,7 @@ parse_cmd_line(int argc, char **argv)
 
 				break;
 			case 'd':
-				debug = 1;
+				debug = DEBUG_PACKETS;
 				break;
 
 			case '?':
@@ -516,175 +524,59 @@ parse_cmd_line(int argc, char **argv)
 	if (optind < argc) {
 		if (debug)
 			printf ("%s \n", argv[optind]);
+		uart_name = argv[optind];
 		if ((uart_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
 			fprintf(stderr, "port %s could not be opened, error %d\n",
 					argv[optind], errno);
 		}
+	} else if (probe_pattern) {
+		uart_fd = uart_probe(probe_pattern, 1);
 	}
 
 	return(0);
 }
 
 void
-init_uart()
-{
-	tcflush(uart_fd, TCIOFLUSH);
-	tcgetattr(uart_fd, &termios);
-
-#ifndef __CYGWIN__
-	cfmakeraw(&termios);
-#else
-	termios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
-                | INLCR | IGNCR | ICRNL | IXON);
-	termios.c_oflag &= ~OPOST;
-	termios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	termios.c_cflag &= ~(CSIZE | PARENB);
-	termios.c_cflag |= CS8;
-#endif
-
-	termios.c_cflag |= CRTSCTS;
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcflush(uart_fd, TCIOFLUSH);
-	cfsetospeed(&termios, B115200);
-	cfsetispeed(&termios, B115200);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-}
-
-void
-dump(uchar *out, int len)
+proc_baudrate()
 {
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			fprintf(stderr, "\n");
+	if (uart_at_speed(termios_baudrate)) {
+		if (debug) {
+			fprintf(stderr, "Already at the baudrate\n");
 		}
 
-		fprintf(stderr, "%02x ", out[i]);
-	}
-
-	fprintf(stderr, "\n");
-}
-
-void
-read_event(int fd, uchar *buffer)
-{
-	int i = 0;
-	int len = 3;
-	int count;
-
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		i += count;
-		len -= count;
-	}
-
-	i += count;
-	len = buffer[2];
-
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		i += count;
-		len -= count;
-	}
-
-	if (debug) {
-		count += i;
-
-		fprintf(stderr, "received %d\n", count);
-		dump(buffer, count);
-	}
-}
-
-void
-hci_send_cmd(uchar *buf, int len)
-{
-	if (debug) {
-		fprintf(stderr, "writing\n");
-		dump(buf, len);
-	}
-
-	write(uart_fd, buf, len);
-}
-
-void
-expired(int sig)
-{
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-	alarm(4);
-}
-
-void
-proc_reset()
-{
-	signal(SIGALRM, expired);
-
-
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-
-	alarm(4);
-
-	read_event(uart_fd, buffer);
-
-	alarm(0);
-}
-
-void
-proc_patchram()
-{
-	int len;
-
-	hci_send_cmd(hci_download_minidriver, sizeof(hci_download_minidriver));
-
-	read_event(uart_fd, buffer);
-
-	if (!no2bytes) {
-		read(uart_fd, &buffer[0], 2);
-	}
-
-	if (tosleep) {
-		usleep(tosleep);
-	}
-
-	while (read(hcdfile_fd, &buffer[1], 3)) {
-		buffer[0] = 0x01;
-
-		len = buffer[3];
-
-		read(hcdfile_fd, &buffer[4], len);
-
-		hci_send_cmd(buffer, len + 4);
-
-		read_event(uart_fd, buffer);
-	}
-
-	if (use_baudrate_for_download) {
-		cfsetospeed(&termios, B115200);
-		cfsetispeed(&termios, B115200);
-		tcsetattr(uart_fd, TCSANOW, &termios);
+		return;
 	}
-	proc_reset();
-}
 
-void
-proc_baudrate()
-{
+	phase_start(PHASE_BAUD);
 
 	if (baudrate > 3000000) {
-		hci_send_cmd(hci_write_uart_clock_setting_48Mhz,
+		hci_send_cmd_or_exit(hci_write_uart_clock_setting_48Mhz,
 			sizeof(hci_write_uart_clock_setting_48Mhz));
 
-		read_event(uart_fd, buffer);
+		/* the rate has not changed yet, so it can still be given up */
+		if (!read_event_timeout(buffer, phase_timeout())) {
+			fprintf(stderr, "UART clock not set in time, staying at "
+				"115200\n");
+			termios_baudrate = 0;
+			return;
+		}
 	}
 
-	hci_send_cmd(hci_update_baud_rate, sizeof(hci_update_baud_rate));
+	hci_send_cmd_or_exit(hci_update_baud_rate,
+		sizeof(hci_update_baud_rate));
 
-	read_event(uart_fd, buffer);
+	/* the switch may have been taken even if its answer was not seen */
+	if (!read_event_timeout(buffer, phase_timeout()) &&
+		!uart_find_speed(termios_baudrate)) {
+		fprintf(stderr, "baud rate not switched in time, staying at "
+			"115200\n");
+		termios_baudrate = 0;
+		return;
+	}
 
-	cfsetospeed(&termios, termios_baudrate);
-	cfsetispeed(&termios, termios_baudrate);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	controller_speed = termios_baudrate;
+
+	uart_set_speed(termios_baudrate);
 
 	if (debug) {
 		fprintf(stderr, "Done setting baudrate\n");
@@ -694,40 +586,28 @@ proc_baudrate()
 void
 proc_bdaddr()
 {
-	hci_send_cmd(hci_write_bd_addr, sizeof(hci_write_bd_addr));
-
-	read_event(uart_fd, buffer);
+	config_add(hci_write_bd_addr, sizeof(hci_write_bd_addr));
 }
 
 void
 proc_enable_lpm()
 {
-	hci_send_cmd(hci_write_sleep_mode, sizeof(hci_write_sleep_mode));
-
-	read_event(uart_fd, buffer);
+	config_add(hci_write_sleep_mode, sizeof(hci_write_sleep_mode));
 }
 
 void
 proc_scopcm()
 {
-	hci_send_cmd(hci_write_sco_pcm_int,
-		sizeof(hci_write_sco_pcm_int));
-
-	read_event(uart_fd, buffer);
-
-	hci_send_cmd(hci_write_pcm_data_format,
+	config_add(hci_write_sco_pcm_int, sizeof(hci_write_sco_pcm_int));
+	config_add(hci_write_pcm_data_format,
 		sizeof(hci_write_pcm_data_format));
-
-	read_event(uart_fd, buffer);
 }
 
 void
 proc_i2s()
 {
-	hci_send_cmd(hci_write_i2spcm_interface_param,
+	config_add(hci_write_i2spcm_interface_param,
 		sizeof(hci_write_i2spcm_interface_param));
-
-	read_event(uart_fd, buffer);
 }
 
 void
@@ -745,6 +625,9 @@ proc_enable_hci()
 		return;
 	}
 	fprintf(stderr, "Done setting line discpline\n");
+
+	notify_ready();
+
 	return;
 }
 
@@ -808,17 +691,32 @@ main (int argc, char **argv)
 		exit(2);
 	}
 
-	init_uart();
+	transport = &uart_transport;
+
+	tune_load(uart_name);
+
+	hcd_prefetch();
+
+	realtime_start();
+
+	init_uart(1);
+
+	uring_start(uart_fd);
+
+	phase_start(PHASE_RESET);
 
 	proc_reset();
 
 	if (use_baudrate_for_download) {
 		if (termios_baudrate) {
 			proc_baudrate();
+
+			/* not if the switch was given up on */
+			launch_at_speed = uart_at_speed(termios_baudrate);
 		}
 	}
 
-	if (hcdfile_fd > 0) {
+	if (have_patchram()) {
 		proc_patchram();
 	}
 
@@ -842,6 +740,22 @@ main (int argc, char **argv)
 		proc_i2s();
 	}
 
+	proc_config();
+
+	uring_stop();
+
+	uart_release();
+
+	tune_save();
+
+	if (debug) {
+		engine_report();
+	}
+
+	if (handoff_fd(uart_fd, uart_name)) {
+		exit(0);
+	}
+
 	if (enable_hci) {
 		proc_enable_hci();
 
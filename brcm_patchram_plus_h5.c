@@ -26,12 +26,17 @@
 **
 **                 It can be invoked from the command line in the form
 **						<-d> to print a debug log
-**						<--patchram patchram_file>
+**						<--patchram patchram_file[,patchram_file...]>
 **						<--baudrate baud_rate>
 **						<--bd_addr bd_address>
 **						<--enable_lpm>
 **						<--enable_h4 | --enable_h5>
+**						<--detect to find out whether the controller wants
+**							H4 with or without RTS/CTS or is already
+**							running H5>
 **						<--use_baudrate_for_download>
+**						<--launch_keeps_baudrate to try the reset after
+**							Launch_RAM at the download baud rate first>
 **						<--scopcm=sco_routing,pcm_interface_rate,frame_type,
 **							sync_mode,clock_mode,lsb_first,fill_bits,
 **							fill_method,fill_num,right_justify>
@@ -81,6 +86,43 @@
 **                          do not generate these two bytes.>
 **						<--tosleep=number of microsseconds to sleep before
 **							patchram download begins.>
+**						<--window=number of patchram records to keep
+**							outstanding, limited by the controller's
+**							command credits.  Default is 1.>
+**						<--script=file of vendor commands to send after
+**							the download>
+**						<--record_timeout=milliseconds to wait for each
+**							command to complete before retrying it, 0 to
+**							wait forever.  Default is 1000.>
+**						<--record_retries=number of times a command is
+**							retried before the download is restarted from
+**							the minidriver.  Default is 3.>
+**						<--tune=state file in which the window and settle
+**							times learned for this device are kept>
+**						<--btsnoop=file to record all HCI traffic to, in
+**							the btsnoop format>
+**						<--log_rate=maximum number of packets logged per
+**							second with -d, 0 for all.  Default is 100.>
+**						<--log_level=0 for errors only, 1 for progress
+**							messages, 2 for HCI packets as well (-d)>
+**						<--duplex to write records and read events on
+**							separate threads>
+**						<--io_uring to batch reads and writes through
+**							io_uring>
+**						<--realtime=SCHED_FIFO priority of the I/O thread,
+**							optionally followed by ,cpu to pin it to>
+**						<--firmware_dir=directory with a brcm_firmware.idx
+**							to pick the patchram file from>
+**						<--probe=pattern of the ports to look for the
+**							controller on, instead of uart_device_name>
+**						<--deadline=milliseconds the whole run may take>
+**						<--ready_fd=descriptor to write READY=1 to once
+**							the line discipline is attached>
+**						<--detach to go into the background at that point>
+**						<--pass_fd=Unix socket of the HCI stack to send the
+**							configured port to, instead of attaching it>
+**						<--fdstore to leave the configured port in the
+**							service manager's descriptor store instead>
 **						uart_device_name
 **
 **                 For example:
@@ -109,6 +151,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include <stdlib.h>
 
@@ -122,6 +165,7 @@
 
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
 #include <time.h>
 
 #ifdef ANDROID
@@ -136,6 +180,8 @@
 
 #endif //ANDROID
 
+#include "brcm_hci_uart.h"
+
 #ifndef N_HCI
 #define N_HCI	15
 #endif
@@ -151,31 +197,22 @@
 #define HCI_UART_LL		4
 #define HCI_UART_H5		5
 
-#define CHIP_ID_4330B2 0x43
-#define CHIP_ID_4329B1 0x29
+#define DETECT_NONE		0
+#define DETECT_H4_RTSCTS	1
+#define DETECT_H4		2
+#define DETECT_H5		3
 
-typedef unsigned char uchar;
+#define DETECT_TIMEOUT_MS	250
 
-int uart_fd = -1;
-int hcdfile_fd = -1;
 int termios_baudrate = 0;
 int bdaddr_flag = 0;
 int enable_lpm = 0;
 int enable_h4 = 0;
 int enable_h5 = 0;
+int detect = 0;
 int use_baudrate_for_download = 0;
-int debug = 0;
 int scopcm = 0;
 int i2s = 0;
-int no2bytes = 0;
-int tosleep = 0;
-
-struct termios termios;
-uchar buffer[1024];
-
-uchar hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
-
-uchar hci_download_minidriver[] = { 0x01, 0x2e, 0xfc, 0x00 };
 
 uchar hci_update_baud_rate[] = { 0x01, 0x18, 0xfc, 0x06, 0x00, 0x00,
 	0x00, 0x00, 0x00, 0x00 };
@@ -196,9 +233,6 @@ uchar hci_write_pcm_data_format[] =
 uchar hci_write_i2spcm_interface_param[] =
 	{ 0x01, 0x6d, 0xFC, 0x04, 0x00, 0x00, 0x00, 0x00 };
 
-uchar hci_read_verbose_config_version_info[] =
-	{ 0x01, 0x79, 0xfc, 0x00 };
-
 uchar slip_sync[] = 
 	{ 0xc0, 0x00, 0x2f, 0x00, 0xd0, 0x01, 0x7e, 0xc0 };
 
@@ -220,84 +254,6 @@ uchar slip_read_local_version_info[] =
 uchar slip_ack[] = 
 	{ 0xc0, 0x48, 0x00, 0x00, 0xb7, 0x5e, 0x8c, 0xc0 };
 
-int
-parse_patchram(char *optarg)
-{
-	char *p;
-
-	if (!(p = strrchr(optarg, '.'))) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(3);
-	}
-
-	p++;
-
-	if (strcasecmp("hcd", p) != 0) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(4);
-	}
-
-	if ((hcdfile_fd = open(optarg, O_RDONLY)) == -1) {
-		fprintf(stderr, "file %s could not be opened, error %d\n", optarg, errno);
-		exit(5);
-	}
-
-	return(0);
-}
-
-void
-BRCM_encode_baud_rate(uint baud_rate, uchar *encoded_baud)
-{
-	if(baud_rate == 0 || encoded_baud == NULL) {
-		fprintf(stderr, "Baudrate not supported!");
-		return;
-	}
-
-	encoded_baud[3] = (uchar)(baud_rate >> 24);
-	encoded_baud[2] = (uchar)(baud_rate >> 16);
-	encoded_baud[1] = (uchar)(baud_rate >> 8);
-	encoded_baud[0] = (uchar)(baud_rate & 0xFF);
-}
-
-typedef struct {
-	int baud_rate;
-	int termios_value;
-} tBaudRates;
-
-tBaudRates baud_rates[] = {
-	{ 115200, B115200 },
-	{ 230400, B230400 },
-	{ 460800, B460800 },
-	{ 500000, B500000 },
-	{ 576000, B576000 },
-	{ 921600, B921600 },
-	{ 1000000, B1000000 },
-	{ 1152000, B1152000 },
-	{ 1500000, B1500000 },
-	{ 2000000, B2000000 },
-	{ 2500000, B2500000 },
-	{ 3000000, B3000000 },
-#ifndef __CYGWIN__
-	{ 3500000, B3500000 },
-	{ 4000000, B4000000 }
-#endif
-};
-
-int
-validate_baudrate(int baud_rate, int *value)
-{
-	unsigned int i;
-
-	for (i = 0; i < (sizeof(baud_rates) / sizeof(tBaudRates)); i++) {
-		if (baud_rates[i].baud_rate == baud_rate) {
-			*value = baud_rates[i].termios_value;
-			return(1);
-		}
-	}
-
-	return(0);
-}
-
 int
 parse_baudrate(char *optarg)
 {
@@ -359,6 +315,13 @@ parse_enable_h5(char *optarg)
 	return(0);
 }
 
+int
+parse_detect(char *optarg)
+{
+	detect = 1;
+	return(0);
+}
+
 int
 parse_scopcm(char *optarg)
 {
@@ -432,13 +395,15 @@ usage(char *argv0)
 {
 	printf("Usage %s:\n", argv0);
 	printf("\t<-d> to print a debug log\n");
-	printf("\t<--patchram patchram_file>\n");
+	printf("\t<--patchram patchram_file[,patchram_file...]>\n");
 	printf("\t<--baudrate baud_rate>\n");
 	printf("\t<--bd_addr bd_address>\n");
 	printf("\t<--enable_lpm>\n");
 	printf("\t<--enable_h4 |--enable_h5>\n");
+	printf("\t<--detect>\n");
 	printf("\t<--use_baudrate_for_download> - Uses the\n");
 	printf("\t\tbaudrate for downloading the firmware\n");
+	printf("\t<--launch_keeps_baudrate>\n");
 	printf("\t<--scopcm=sco_routing,pcm_interface_rate,frame_type,\n");
 	printf("\t\tsync_mode,clock_mode,lsb_first,fill_bits,\n");
 	printf("\t\tfill_method,fill_num,right_justify>\n");
@@ -469,6 +434,24 @@ usage(char *argv0)
 	printf("\t\tbefore starting patchram download. Newer chips\n");
 	printf("\t\tdo not generate these two bytes.>\n");
 	printf("\t<--tosleep=microseconds>\n");
+	printf("\t<--window=records>\n");
+	printf("\t<--script=config_script>\n");
+	printf("\t<--record_timeout=milliseconds>\n");
+	printf("\t<--record_retries=retries>\n");
+	printf("\t<--tune=state_file>\n");
+	printf("\t<--btsnoop=trace_file>\n");
+	printf("\t<--log_rate=packets_per_second>\n");
+	printf("\t<--log_level=level>\n");
+	printf("\t<--duplex>\n");
+	printf("\t<--io_uring>\n");
+	printf("\t<--realtime=priority[,cpu]>\n");
+	printf("\t<--firmware_dir=directory>\n");
+	printf("\t<--probe=pattern>\n");
+	printf("\t<--deadline=milliseconds>\n");
+	printf("\t<--ready_fd=descriptor>\n");
+	printf("\t<--detach>\n");
+	printf("\t<--pass_fd=socket_path>\n");
+	printf("\t<--fdstore>\n");
 	printf("\tuart_device_name\n");
 }
 
@@ -483,7 +466,15 @@ parse_cmd_line(int argc, char **argv)
 	PFI parse[] = { parse_patchram, parse_baudrate,
 		parse_bdaddr, parse_enable_lpm, parse_enable_h4,
 		parse_enable_h5, parse_use_baudrate_for_download,
-		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep};
+		parse_launch_keeps_baudrate,
+		parse_scopcm, parse_i2s, parse_no2bytes, parse_tosleep,
+		parse_window, parse_script, parse_record_timeout,
+		parse_record_retries, parse_tune, parse_btsnoop,
+		parse_log_rate, parse_log_level, parse_duplex, parse_io_uring,
+		parse_realtime, parse_firmware_dir, parse_probe,
+		parse_detect, parse_deadline,
+		parse_ready_fd, parse_detach, parse_pass_fd,
+		parse_fdstore};
 
 	while (1) {
 		int this_option_optind = optind ? optind : 1;
@@ -497,10 +488,30 @@ parse_cmd_line(int argc, char **argv)
 			{"enable_h4", 0, 0, 0},
 			{"enable_h5", 0, 0, 0},
 			{"use_baudrate_for_download", 0, 0, 0},
+			{"launch_keeps_baudrate", 0, 0, 0},
 			{"scopcm", 1, 0, 0},
 			{"i2s", 1, 0, 0},
 			{"no2bytes", 0, 0, 0},
 			{"tosleep", 1, 0, 0},
+			{"window", 1, 0, 0},
+			{"script", 1, 0, 0},
+			{"record_timeout", 1, 0, 0},
+			{"record_retries", 1, 0, 0},
+			{"tune", 1, 0, 0},
+			{"btsnoop", 1, 0, 0},
+			{"log_rate", 1, 0, 0},
+			{"log_level", 1, 0, 0},
+			{"duplex", 0, 0, 0},
+			{"io_uring", 0, 0, 0},
+			{"realtime", 1, 0, 0},
+			{"firmware_dir", 1, 0, 0},
+			{"probe", 1, 0, 0},
+			{"detect", 0, 0, 0},
+			{"deadline", 1, 0, 0},
+			{"ready_fd", 1, 0, 0},
+			{"detach", 0, 0, 0},
+			{"pass_fd", 1, 0, 0},
+			{"fdstore", 0, 0, 0},
 			{0, 0, 0, 0}
 		};
 
@@ -525,7 +536,7 @@ parse_cmd_line(int argc, char **argv)
 
 				break;
 			case 'd':
-				debug = 1;
+				debug = DEBUG_PACKETS;
 				break;
 
 			case '?':
@@ -548,252 +559,107 @@ parse_cmd_line(int argc, char **argv)
 	if (optind < argc) {
 		if (debug)
 			printf ("%s \n", argv[optind]);
+		uart_name = argv[optind];
 		if ((uart_fd = open(argv[optind], O_RDWR | O_NOCTTY)) == -1) {
 			fprintf(stderr, "port %s could not be opened, error %d\n",
 					argv[2], errno);
 		}
+	} else if (probe_pattern) {
+		uart_fd = uart_probe(probe_pattern, 0);
 	}
 
 	return(0);
 }
 
+/*
+** SLIP frames are not HCI commands, so they go straight to the UART and
+** stay out of the btsnoop trace and the command count.
+*/
 void
-init_uart()
-{
-	tcflush(uart_fd, TCIOFLUSH);
-	tcgetattr(uart_fd, &termios);
-
-#ifndef __CYGWIN__
-	cfmakeraw(&termios);
-#else
-	termios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP
-                | INLCR | IGNCR | ICRNL | IXON);
-	termios.c_oflag &= ~OPOST;
-	termios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	termios.c_cflag &= ~(CSIZE | PARENB);
-	termios.c_cflag |= CS8;
-#endif
-
-	termios.c_cflag &= ~CRTSCTS;
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-	tcflush(uart_fd, TCIOFLUSH);
-	tcflush(uart_fd, TCIOFLUSH);
-	cfsetospeed(&termios, B115200);
-	cfsetispeed(&termios, B115200);
-	tcsetattr(uart_fd, TCSANOW, &termios);
-}
-
-void
-dump(uchar *out, int len)
-{
-	int i;
-
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			fprintf(stderr, "\n");
-		}
-
-		fprintf(stderr, "%02x ", out[i]);
-	}
-
-	fprintf(stderr, "\n");
-}
-
-void
-read_event(int fd, uchar *buffer)
-{
-	int i = 0;
-	int len = 3;
-	int count;
-
-	i = 0;
-	len = 3;
-
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		if (debug) {
-			count += i;
-
-			fprintf(stderr, "received %d len %d\n", count, len);
-			dump(buffer, count);
-		}
-
-		i += count;
-		len -= count;
-	}
-
-	i += count;
-	len = buffer[2];
-
-	while ((count = read(fd, &buffer[i], len)) < len) {
-		i += count;
-		len -= count;
-	}
-
-	if (debug) {
-		count += i;
-
-		fprintf(stderr, "received %d\n", count);
-		dump(buffer, count);
-	}
-}
-
-void
-hci_send_cmd(uchar *buf, int len)
+slip_send(uchar *buf, int len)
 {
-	if (debug) {
-		fprintf(stderr, "writing\n");
-		dump(buf, len);
+	if (debug_log) {
+		log_packet("writing slip", buf, len);
 	}
 
-	write(uart_fd, buf, len);
-}
-
-void
-expired(int sig)
-{
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-	alarm(4);
+	transport->send(buf, len);
 }
 
 void
 slip_expired(int sig)
 {
-	hci_send_cmd(slip_sync, sizeof(slip_sync));
+	slip_send(slip_sync, sizeof(slip_sync));
 	alarm(4);
 }
 
 void
 slip_config_expired(int sig)
 {
-	hci_send_cmd(slip_config, sizeof(slip_config));
-	alarm(4);
-}
-
-void
-proc_reset()
-{
-	signal(SIGALRM, expired);
-
-	hci_send_cmd(hci_reset, sizeof(hci_reset));
-
+	slip_send(slip_config, sizeof(slip_config));
 	alarm(4);
-
-	read_event(uart_fd, buffer);
-
-	alarm(0);
 }
 
 void
-proc_patchram()
+proc_baudrate()
 {
-	int len;
-	uchar chip_id;
-
-	hci_send_cmd(hci_read_verbose_config_version_info, 
-		sizeof(hci_read_verbose_config_version_info));
-
-	read_event(uart_fd, buffer);
-
-	chip_id = buffer[7];
-
-	if (debug) {
-		fprintf(stderr, "chip_id is %02x\n", chip_id);
-	}
-
-	if (chip_id == CHIP_ID_4330B2) {
-		no2bytes = 1;
-	}
-
-	hci_send_cmd(hci_download_minidriver, sizeof(hci_download_minidriver));
-
-	read_event(uart_fd, buffer);
-
-	if (!no2bytes) {
-		read(uart_fd, &buffer[0], 2);
-	}
+	if (uart_at_speed(termios_baudrate)) {
+		if (debug) {
+			fprintf(stderr, "Already at the baudrate\n");
+		}
 
-	if (tosleep) {
-		usleep(tosleep);
+		return;
 	}
 
-	while (read(hcdfile_fd, &buffer[1], 3)) {
-		buffer[0] = 0x01;
-
-		len = buffer[3];
-
-		read(hcdfile_fd, &buffer[4], len);
+	phase_start(PHASE_BAUD);
 
-		hci_send_cmd(buffer, len + 4);
+	hci_send_cmd_or_exit(hci_update_baud_rate,
+		sizeof(hci_update_baud_rate));
 
-		read_event(uart_fd, buffer);
-	}
-
-	if (use_baudrate_for_download) {
-		cfsetospeed(&termios, B115200);
-		cfsetispeed(&termios, B115200);
-		tcsetattr(uart_fd, TCSANOW, &termios);
+	/* the switch may have been taken even if its answer was not seen */
+	if (!read_event_timeout(buffer, phase_timeout()) &&
+		!uart_find_speed(termios_baudrate)) {
+		fprintf(stderr, "baud rate not switched in time, staying at "
+			"115200\n");
+		termios_baudrate = 0;
+		return;
 	}
 
-	proc_reset();
-}
+	controller_speed = termios_baudrate;
 
-void
-proc_baudrate()
-{
-	hci_send_cmd(hci_update_baud_rate, sizeof(hci_update_baud_rate));
-
-	read_event(uart_fd, buffer);
-
-	cfsetospeed(&termios, termios_baudrate);
-	cfsetispeed(&termios, termios_baudrate);
-	tcsetattr(uart_fd, TCSANOW, &termios);
+	uart_set_speed(termios_baudrate);
 
 	if (debug) {
 		fprintf(stderr, "Done setting baudrate\n");
 	}
 
-	sleep(1);
+	usleep(baud_settle);
 }
 
 void
 proc_bdaddr()
 {
-	hci_send_cmd(hci_write_bd_addr, sizeof(hci_write_bd_addr));
-
-	read_event(uart_fd, buffer);
+	config_add(hci_write_bd_addr, sizeof(hci_write_bd_addr));
 }
 
 void
 proc_enable_lpm()
 {
-	hci_send_cmd(hci_write_sleep_mode, sizeof(hci_write_sleep_mode));
-
-	read_event(uart_fd, buffer);
+	config_add(hci_write_sleep_mode, sizeof(hci_write_sleep_mode));
 }
 
 void
 proc_scopcm()
 {
-	hci_send_cmd(hci_write_sco_pcm_int,
-		sizeof(hci_write_sco_pcm_int));
-
-	read_event(uart_fd, buffer);
-
-	hci_send_cmd(hci_write_pcm_data_format,
+	config_add(hci_write_sco_pcm_int, sizeof(hci_write_sco_pcm_int));
+	config_add(hci_write_pcm_data_format,
 		sizeof(hci_write_pcm_data_format));
-
-	read_event(uart_fd, buffer);
 }
 
 void
 proc_i2s()
 {
-	hci_send_cmd(hci_write_i2spcm_interface_param,
+	config_add(hci_write_i2spcm_interface_param,
 		sizeof(hci_write_i2spcm_interface_param));
-
-	read_event(uart_fd, buffer);
 }
 
 void
@@ -816,6 +682,8 @@ proc_enable_hci()
 		fprintf(stderr, "Done setting line discpline\n");
 	}
 
+	notify_ready();
+
 	return;
 }
 
@@ -866,6 +734,27 @@ read_default_bdaddr()
 }
 #endif
 
+/*
+** Waits for the controller to send something, for no longer than what is
+** left of --deadline.  The SIGALRM resends cut the wait short, so it is
+** started again after each of them.
+*/
+void
+slip_wait()
+{
+	struct pollfd pfd;
+	int count;
+
+	pfd.fd = uart_fd;
+	pfd.events = POLLIN;
+
+	while ((count = poll(&pfd, 1, deadline_clamp(-1))) <= 0) {
+		if (count == 0) {
+			deadline_check();
+		}
+	}
+}
+
 int
 proc_slip_sync()
 {
@@ -874,23 +763,23 @@ proc_slip_sync()
 
 	signal(SIGALRM, slip_expired);
 
-	hci_send_cmd(slip_sync, sizeof(slip_sync));
+	slip_send(slip_sync, sizeof(slip_sync));
 
 	alarm(4);
 
 	while (!ret) {
+		slip_wait();
 		count = read(uart_fd, buffer, sizeof(slip_sync));
 
-		if (debug) {
-			fprintf(stderr, "received slip sync %d\n", count);
-			dump(buffer, count);
+		if (debug_log) {
+			log_packet("received slip sync", buffer, count);
 		}
 
 		if (buffer[6] == 0x7d) {
 			alarm(0);
 			ret = 1;
 		} else { 
-			hci_send_cmd(slip_sync_response, sizeof(slip_sync_response));
+			slip_send(slip_sync_response, sizeof(slip_sync_response));
 		}
 	}
 
@@ -905,36 +794,121 @@ proc_slip_config()
 
 	signal(SIGALRM, slip_config_expired);
 
-	hci_send_cmd(slip_config, sizeof(slip_config));
+	slip_send(slip_config, sizeof(slip_config));
 
 	alarm(4);
 
 	while (!ret) {
+		slip_wait();
 		count = read(uart_fd, buffer, sizeof(slip_config_response));
 
-		if (debug) {
-			fprintf(stderr, "received slip config %d\n", count);
-			dump(buffer, count);
+		if (debug_log) {
+			log_packet("received slip config", buffer, count);
 		}
 
 		if (count == 8) {
 			if (buffer[5] == 0x03 && buffer[6] == 0xfc) {
-				hci_send_cmd(slip_config_null_response, 
+				slip_send(slip_config_null_response, 
 					sizeof(slip_config_null_response));
 			} else {
-				hci_send_cmd(slip_sync_response, sizeof(slip_sync_response));
+				slip_send(slip_sync_response, sizeof(slip_sync_response));
 			}
 		} else if (buffer[7] == 0x7b) {
 			alarm(0);
 			ret = 1;
 		} else { 
-			hci_send_cmd(slip_config_response, sizeof(slip_config_response));
+			slip_send(slip_config_response, sizeof(slip_config_response));
 		}
 	}
 
 	return(ret);
 }
 
+/*
+** Returns 1 if an HCI_Reset sent with the current line settings gets its
+** Command Complete back within DETECT_TIMEOUT_MS.
+*/
+int
+detect_reset()
+{
+	unsigned int deadline = now_ms() + DETECT_TIMEOUT_MS;
+	int timeout;
+
+	hci_send_cmd(hci_reset, sizeof(hci_reset));
+
+	while ((timeout = deadline - now_ms()) > 0) {
+		if (read_event_timeout(buffer, timeout) == 0) {
+			break;
+		}
+
+		if (buffer[1] == HCI_EV_CMD_COMPLETE &&
+			buffer[4] == hci_reset[1] && buffer[5] == hci_reset[2]) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+/*
+** Returns 1 if a SLIP frame comes back within DETECT_TIMEOUT_MS of a SYNC.
+*/
+int
+detect_sync()
+{
+	unsigned int deadline = now_ms() + DETECT_TIMEOUT_MS;
+	uchar byte;
+	int count = -1;
+	int timeout;
+
+	slip_send(slip_sync, sizeof(slip_sync));
+
+	while ((timeout = deadline - now_ms()) > 0) {
+		if (transport->read_bytes(&byte, 1, timeout) < 1) {
+			break;
+		}
+
+		if (byte != 0xc0) {
+			if (count >= 0) {
+				count++;
+			}
+		} else if (count >= 4) {
+			return(1);
+		} else {
+			count = 0;
+		}
+	}
+
+	return(0);
+}
+
+/*
+** Works out how the controller is attached.  A controller waiting for a
+** download answers HCI_Reset, with RTS/CTS if it drives CTS and without
+** otherwise.  One that is already running three-wire firmware only
+** answers SYNC.  The line is left set up for whatever answered.
+*/
+int
+proc_detect()
+{
+	init_uart(1);
+
+	if (detect_reset()) {
+		return(DETECT_H4_RTSCTS);
+	}
+
+	init_uart(0);
+
+	if (detect_reset()) {
+		return(DETECT_H4);
+	}
+
+	if (detect_sync()) {
+		return(DETECT_H5);
+	}
+
+	return(DETECT_NONE);
+}
 
 slip_read()
 {
@@ -942,9 +916,8 @@ slip_read()
 
 	count = read(uart_fd, buffer, 1024);
 
-	if (debug) {
-		fprintf(stderr, "received slip config %d\n", count);
-		dump(buffer, count);
+	if (debug_log) {
+		log_packet("received slip config", buffer, count);
 	}
 }
 
@@ -953,10 +926,13 @@ int
 main (int argc, char **argv)
 {
 	char byte;
+	int detected = DETECT_NONE;
 #ifdef ANDROID
 	read_default_bdaddr();
 #endif
 
+	baud_settle = 1000000;
+
 	if (parse_cmd_line(argc, argv)) {
 		exit(1);
 	}
@@ -965,38 +941,86 @@ main (int argc, char **argv)
 		exit(2);
 	}
 
-	init_uart();
+	transport = &uart_transport;
+
+	tune_load(uart_name);
+
+	hcd_prefetch();
+
+	realtime_start();
+
+	if (!detect) {
+		init_uart(0);
+	} else if ((detected = proc_detect()) == DETECT_NONE) {
+		fprintf(stderr, "no answer to HCI_Reset or SYNC\n");
+		exit(2);
+	}
+
+	uring_start(uart_fd);
+
+	if (detected == DETECT_H5) {
+		/* the firmware is already running, only attach it */
+		if (debug) {
+			fprintf(stderr, "controller answered SYNC, skipping the "
+				"download\n");
+		}
+
+		enable_h4 = 0;
+		enable_h5 = 1;
+	} else {
+		if (debug && detect) {
+			fprintf(stderr, "controller answered HCI_Reset %s RTS/CTS\n",
+				detected == DETECT_H4_RTSCTS ? "with" : "without");
+		}
+
+		phase_start(PHASE_RESET);
+
+		proc_reset();
 
-	proc_reset();
+		if (use_baudrate_for_download) {
+			if (termios_baudrate) {
+				proc_baudrate();
+
+				/* not if the switch was given up on */
+				launch_at_speed = uart_at_speed(termios_baudrate);
+			}
+		}
+
+		if (have_patchram()) {
+			proc_patchram();
+		}
 
-	if (use_baudrate_for_download) {
 		if (termios_baudrate) {
 			proc_baudrate();
 		}
-	}
 
-	if (hcdfile_fd > 0) {
-		proc_patchram();
-	}
+		if (bdaddr_flag) {
+			proc_bdaddr();
+		}
 
-	if (termios_baudrate) {
-		proc_baudrate();
-	}
+		if (enable_lpm) {
+			proc_enable_lpm();
+		}
 
-	if (bdaddr_flag) {
-		proc_bdaddr();
-	}
+		if (scopcm) {
+			proc_scopcm();
+		}
 
-	if (enable_lpm) {
-		proc_enable_lpm();
-	}
+		if (i2s) {
+			proc_i2s();
+		}
 
-	if (scopcm) {
-		proc_scopcm();
+		proc_config();
 	}
 
-	if (i2s) {
-		proc_i2s();
+	uring_stop();
+
+	uart_release();
+
+	tune_save();
+
+	if (debug) {
+		engine_report();
 	}
 
 	if (enable_h5) {
@@ -1020,6 +1044,11 @@ main (int argc, char **argv)
 		exit(1);
 	}
 
+	/* with H5 the three-wire link is up before the port is handed over */
+	if (handoff_fd(uart_fd, uart_name)) {
+		exit(0);
+	}
+
 	if (enable_h4 || enable_h5) {
 
 		if (enable_h5) {
@@ -28,8 +28,37 @@
 **
 **                 It can be invoked from the command line in the form
 **						<-d> to print a debug log
-**						<--patchram patchram_file>
+**						<--patchram patchram_file[,patchram_file...]>
 **						<--bd_addr bd_address>
+**						<--tosleep=number of microsseconds to sleep before
+**							patchram download begins.  Default is 1000000.>
+**						<--window=number of patchram records to keep
+**							outstanding.  Default is 1.>
+**						<--script=file of vendor commands to send after
+**							the download>
+**						<--record_timeout=milliseconds to wait for each
+**							command to complete before retrying it, 0 to
+**							wait forever.  Default is 1000.>
+**						<--record_retries=number of times a command is
+**							retried before the download is restarted from
+**							the minidriver.  Default is 3.>
+**						<--tune=state file in which the window and settle
+**							times learned for this device are kept>
+**						<--btsnoop=file to record all HCI traffic to, in
+**							the btsnoop format>
+**						<--log_rate=maximum number of packets logged per
+**							second with -d, 0 for all.  Default is 100.>
+**						<--log_level=0 for errors only, 1 for progress
+**							messages, 2 for HCI packets as well (-d)>
+**						<--duplex to write records and read events on
+**							separate threads>
+**						<--io_uring to batch reads and writes through
+**							io_uring>
+**						<--realtime=SCHED_FIFO priority of the I/O thread,
+**							optionally followed by ,cpu to pin it to>
+**						<--firmware_dir=directory with a brcm_firmware.idx
+**							to pick the patchram file from>
+**						<--deadline=milliseconds the whole run may take>
 **						bluez_device_name
 **
 **                 For example:
@@ -63,6 +92,8 @@
 
 #include <string.h>
 #include <signal.h>
+#include <poll.h>
+#include <unistd.h>
 
 #ifdef ANDROID
 #include <cutils/properties.h>
@@ -75,17 +106,11 @@
   { if(x==stderr) LOGE(__VA_ARGS__); else fprintf(x, __VA_ARGS__); }
 #endif //ANDROID
 
+#include "brcm_hci_engine.h"
+
 int sock = -1;
-int hcdfile_fd = -1;
 int bdaddr_flag = 0;
 int enable_lpm = 0;
-int debug = 0;
-
-unsigned char buffer[1024];
-
-unsigned char hci_reset[] = { 0x01, 0x03, 0x0c, 0x00 };
-
-unsigned char hci_download_minidriver[] = { 0x01, 0x2e, 0xfc, 0x00 };
 
 unsigned char hci_write_bd_addr[] = { 0x01, 0x01, 0xfc, 0x06, 
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -93,31 +118,6 @@ unsigned char hci_write_bd_addr[] = { 0x01, 0x01, 0xfc, 0x06,
 
 #define HCIT_TYPE_COMMAND 1
 
-int
-parse_patchram(char *optarg)
-{
-	char *p;
-
-	if (!(p = strrchr(optarg, '.'))) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(3);
-	}
-
-	p++;
-
-	if (strcasecmp("hcd", p) != 0) {
-		fprintf(stderr, "file %s not an HCD file\n", optarg);
-		exit(4);
-	}
-
-	if ((hcdfile_fd = open(optarg, O_RDONLY)) == -1) {
-		fprintf(stderr, "file %s could not be opened, error %d\n", optarg, errno);
-		exit(5);
-	}
-
-	return(0);
-}
-
 int
 parse_bdaddr(char *optarg)
 {
@@ -137,6 +137,18 @@ parse_bdaddr(char *optarg)
 	return(0);
 }
 
+int
+parse_tosleep(char *optarg)
+{
+	tosleep = atoi(optarg);
+
+	if (tosleep <= 0) {
+		return(1);
+	}
+
+	return(0);
+}
+
 int
 parse_cmd_line(int argc, char **argv)
 {
@@ -146,7 +158,11 @@ parse_cmd_line(int argc, char **argv)
 
 	typedef int (*PFI)();
 
-	PFI parse_param[] = { parse_patchram, parse_bdaddr };
+	PFI parse_param[] = { parse_patchram, parse_bdaddr, parse_tosleep,
+		parse_window, parse_script, parse_record_timeout,
+		parse_record_retries, parse_tune, parse_btsnoop,
+		parse_log_rate, parse_log_level, parse_duplex, parse_io_uring,
+		parse_realtime, parse_firmware_dir, parse_deadline };
 
 	while (1)
 	{
@@ -156,6 +172,20 @@ parse_cmd_line(int argc, char **argv)
 	   	static struct option long_options[] = {
 	     {"patchram", 1, 0, 0},
 	     {"bd_addr", 1, 0, 0},
+	     {"tosleep", 1, 0, 0},
+	     {"window", 1, 0, 0},
+	     {"script", 1, 0, 0},
+	     {"record_timeout", 1, 0, 0},
+	     {"record_retries", 1, 0, 0},
+	     {"tune", 1, 0, 0},
+	     {"btsnoop", 1, 0, 0},
+	     {"log_rate", 1, 0, 0},
+	     {"log_level", 1, 0, 0},
+	     {"duplex", 0, 0, 0},
+	     {"io_uring", 0, 0, 0},
+	     {"realtime", 1, 0, 0},
+	     {"firmware_dir", 1, 0, 0},
+	     {"deadline", 1, 0, 0},
 	     {0, 0, 0, 0}
 	   	};
 
@@ -179,7 +209,7 @@ parse_cmd_line(int argc, char **argv)
 		break;
 
 		case 'd':
-			debug = 1;
+			debug = DEBUG_PACKETS;
 		break;
 
 	    case '?':
@@ -188,8 +218,22 @@ parse_cmd_line(int argc, char **argv)
 
 			printf("Usage %s:\n", argv[0]);
 			printf("\t<-d> to print a debug log\n");
-			printf("\t<--patchram patchram_file>\n");
+			printf("\t<--patchram patchram_file[,patchram_file...]>\n");
 			printf("\t<--bd_addr bd_address>\n");
+			printf("\t<--tosleep=microseconds>\n");
+			printf("\t<--window=records>\n");
+			printf("\t<--script=config_script>\n");
+			printf("\t<--record_timeout=milliseconds>\n");
+			printf("\t<--record_retries=retries>\n");
+			printf("\t<--tune=state_file>\n");
+			printf("\t<--btsnoop=trace_file>\n");
+			printf("\t<--log_rate=packets_per_second>\n");
+			printf("\t<--log_level=level>\n");
+			printf("\t<--duplex>\n");
+			printf("\t<--io_uring>\n");
+			printf("\t<--realtime=priority[,cpu]>\n");
+			printf("\t<--firmware_dir=directory>\n");
+			printf("\t<--deadline=milliseconds>\n");
 			printf("\tbluez_device_name\n");
 	       	break;
 
@@ -231,52 +275,50 @@ init_hci()
 	setsockopt(sock, SOL_HCI, HCI_FILTER, &flt, sizeof(flt));
 }
 
-void
-dump(unsigned char *out, int len)
+static int
+sock_read_event(unsigned char *buf, int size, int timeout_ms)
 {
-	int i;
+	struct pollfd pfd;
+	int count;
 
-	for (i = 0; i < len; i++) {
-		if (i && !(i % 16)) {
-			fprintf(stderr, "\n");
-		}
+	pfd.fd = sock;
+	pfd.events = POLLIN;
 
-		fprintf(stderr, "%02x ", out[i]);
-	}
+	while (1) {
+		if (timeout_ms >= 0) {
+			count = poll(&pfd, 1, timeout_ms);
 
-	fprintf(stderr, "\n");
-}
+			if (count == 0) {
+				return(0);
+			}
 
-void
-read_event(int fd, unsigned char *buffer)
-{
-	int i = 0;
-	int len = 260;
-	int count;
+			if (count < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
 
-	count = read(sock, &buffer[i], 260);
+				return(-1);
+			}
+		}
 
-	if (debug) {
-		count += i;
+		count = read(sock, buf, size);
 
-		fprintf(stderr, "received %d\n", count);
-		dump(buffer, count);
+		if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+
+		return(count);
 	}
 }
 
-void
-hci_send_cmd_func(unsigned char *buf, int len)
+static int
+sock_send(unsigned char *buf, int len)
 {
 	uint8_t type;
 	hci_command_hdr hc;
 	struct iovec iv[3];
 	int ivn;
 
-	if (debug) {
-		fprintf(stderr, "writing\n");
-		dump(buf, len);
-	}
-
 	if (buf[0] == HCIT_TYPE_COMMAND) {
 		type = HCI_COMMAND_PKT;
 	} else {
@@ -285,10 +327,10 @@ hci_send_cmd_func(unsigned char *buf, int len)
 				continue;
 			}
 
-			return;
+			return(-1);
 		}
 
-		return;
+		return(len);
 	}
 
 	hc.opcode = buf[1] | (buf[2] << 8);
@@ -311,65 +353,26 @@ hci_send_cmd_func(unsigned char *buf, int len)
 			continue;
 		}
 
-		return;
+		return(-1);
 	}
 
+	return(len);
 }
 
-void
-expired(int sig)
-{
-	hci_send_cmd_func(hci_reset, sizeof(hci_reset));
-	alarm(4);
-}
-
-void
-proc_reset()
-{
-	signal(SIGALRM, expired);
-
-
-	hci_send_cmd_func(hci_reset, sizeof(hci_reset));
-
-	alarm(4);
-
-	read_event(sock, buffer);
-
-	alarm(0);
-}
-
-void
-proc_patchram()
-{
-	int len;
-
-	hci_send_cmd_func(hci_download_minidriver, sizeof(hci_download_minidriver));
-
-	read_event(sock, buffer);
-
-	sleep(1);
-
-	while (read(hcdfile_fd, &buffer[1], 3)) {
-		buffer[0] = 0x01;
-
-		len = buffer[3];
-
-		read(hcdfile_fd, &buffer[4], len);
-
-		hci_send_cmd_func(buffer, len + 4);
-
-		read_event(sock, buffer);
-	}
-
-	proc_reset();
-}
+tHciTransport sock_transport = {
+	"hci socket",
+	sock_send,
+	sock_read_event,
+	NULL,
+	NULL,
+	NULL,
+	&sock
+};
 
 void
 proc_bdaddr()
 {
-	hci_send_cmd_func(hci_write_bd_addr, sizeof(hci_write_bd_addr));
-
-	read_event(sock, buffer);
+	config_add(hci_write_bd_addr, sizeof(hci_write_bd_addr));
 }
 
 #ifdef ANDROID
@@ -423,17 +426,34 @@ main (int argc, char **argv)
 	read_default_bdaddr();
 #endif
 
+	/* The HCI socket carries whole packets, there are no raw bytes to
+	 * wait for after the minidriver, only its settle time. */
+	no2bytes = 1;
+	tosleep = 1000000;
+
 	parse_cmd_line(argc, argv);
 
 	if (sock < 0) {
 		exit(1);
 	}
 
+	transport = &sock_transport;
+
+	tune_load(argv[optind]);
+
+	hcd_prefetch();
+
+	realtime_start();
+
 	init_hci();
 
+	uring_start(sock);
+
+	phase_start(PHASE_RESET);
+
 	proc_reset();
 
-	if (hcdfile_fd > 0) {
+	if (have_patchram()) {
 		proc_patchram();
 	}
 
@@ -441,5 +461,15 @@ main (int argc, char **argv)
 		proc_bdaddr();
 	}
 
+	proc_config();
+
+	uring_stop();
+
+	tune_save();
+
+	if (debug) {
+		engine_report();
+	}
+
 	return(0);
 }